@@ -0,0 +1,268 @@
+#!/usr/bin/perl
+##############################################################################
+# generate_fpdb.pl
+#
+# Compiles fingerprints.dat into termread.fpdb, the binary, hash
+# indexed fingerprint database that termread maps with mmap(2).
+#
+#   perl generate_fpdb.pl fingerprints.dat termread.fpdb
+#
+# For license, see embedded at the bottom of termread.c
+#
+# FILE LAYOUT (all integers are 32 bit little-endian)
+#
+#   header    magic "TRFPDB\0\0", format, serial, nbuckets, nmatch,
+#             nprofile, off_buckets, off_matches, off_profiles,
+#             off_strings, len_strings
+#   buckets   nbuckets x { hash, match index + 1 (0 is empty) }
+#             open addressing, linear probe, nbuckets a power of 2
+#   matches   nmatch x { key offset, key length, profile index }
+#   profiles  nprofile x { name offset, terms offset, flags offset,
+#             colors, emoji/truecolor/mode/bits as four bytes }
+#   strings   NUL terminated, offset 0 is the empty string
+#
+# A match key is its fields joined by \037 in the order da1, da2, da3,
+# enq, each as "<n>=<raw reply>" or "<n>~<class>", where <n> is 1, 2,
+# 3 or E.  The hash is 32 bit FNV-1a over the key bytes.  termread.c
+# builds the same keys from live replies, so these must stay in step.
+#
+##
+use strict;
+use warnings qw{ all };
+
+use English qw( -no_match_vars );
+
+my $FORMAT = 1;
+my %FIELD  = ( 'da1' => '1', 'da2' => '2', 'da3' => '3', 'enq' => 'E' );
+my %MODE   = ( '' => 0, 'semi' => 1, 'colon' => 2 );
+
+MAIN: {
+    my $src = shift @ARGV || 'fingerprints.dat';
+    my $dst = shift @ARGV || 'termread.fpdb';
+
+    my ( $serial, $profiles, $matches ) = read_source($src);
+    write_db( $dst, $serial, $profiles, $matches );
+    printf "%s: serial %d, %d profiles, %d match keys\n",
+        $dst, $serial, scalar @{$profiles}, scalar @{$matches};
+} ## end MAIN:
+
+sub fail
+{
+    my ( $file, $line, $msg ) = @_;
+    printf *STDERR, "%s:%d: %s\n", $file, $line, $msg;
+    exit(1);
+}
+
+# Turn termread's printed escapes back into the raw reply bytes
+sub unescape
+{
+    my $in = shift;
+    $in =~ s{\\(0[0-7]{0,3}|x[0-9a-fA-F]{1,2}|e|a|\\)}{
+        my $e = $1;
+          ( 'e' eq $e )           ? "\033"
+        : ( 'a' eq $e )           ? "\007"
+        : ( '\\' eq $e )          ? "\\"
+        : ( $e =~ m/^x(.*)$/ )    ? chr( hex($1) )
+        :                           chr( oct($e) )
+    }ge;
+    return $in;
+}
+
+# A class is Ps[;4][;22] for da1 and Pp[;Pv] for da2
+sub normal_class
+{
+    my ( $field, $val ) = @_;
+    my @p = split( /;/, $val );
+    if ( 'da1' eq $field ) {
+        my $ps1  = shift @p;
+        my %has  = map { $_ => 1 } @p;
+        my $out  = $ps1;
+        $out .= ';4'  if ( $has{4} );
+        $out .= ';22' if ( $has{22} );
+        return $out;
+    }
+    return join( ';', @p[ 0 .. ( $#p < 1 ? $#p : 1 ) ] );
+} ## end sub normal_class
+
+# Expand any `#` (one digit) in a reply into every possible reply
+sub expand_digits
+{
+    my @out = ( shift );
+    while ( grep { m/#/ } @out ) {
+        @out = map {
+            my $v = $_;
+            ( $v =~ m/#/ )
+                ? map { my $d = $v; $d =~ s/#/$_/; $d } ( 0 .. 9 )
+                : ($v)
+        } @out;
+    }
+    return @out;
+} ## end sub expand_digits
+
+sub read_source
+{
+    my $file     = shift;
+    my $serial   = 0;
+    my @profiles = ();
+    my %pindex   = ();
+    my @matches  = ();
+    my %seen     = ();
+    my $fh       = undef;
+
+    open( $fh, '<', $file )
+        or fail( $file, 0, "Unable to open: $OS_ERROR" );
+    while ( my $line = readline($fh) ) {
+        my $ln = $INPUT_LINE_NUMBER;
+        chomp $line;
+        next if ( $line =~ m/^\s*(#|$)/ );
+        my ( $kind, @tok ) = split( /\s+/, $line );
+
+        if ( 'serial' eq $kind ) {
+            $serial = $tok[0];
+        }
+        elsif ( 'profile' eq $kind ) {
+            my $p = { 'name' => shift @tok, 'terms' => q{}, 'flags' => q{},
+                      'bits' => 0 };
+            foreach my $t (@tok) {
+                my ( $k, $v ) = split( /=/, $t, 2 );
+                if ( 'info' eq $k ) {
+                    my @i = split( /:/, $v );
+                    $p->{'emoji'}     = $i[0] || 0;
+                    $p->{'colors'}    = $i[1] || 0;
+                    $p->{'truecolor'} = $i[2] || 0;
+                    exists $MODE{ $i[3] || q{} }
+                        or fail( $file, $ln, "Unknown mode '$i[3]'" );
+                    $p->{'mode'}      = $MODE{ $i[3] || q{} };
+                }
+                elsif ( 'terms' eq $k ) {
+                    $p->{'terms'} = join( ' ', split( /,/, $v ) );
+                }
+                elsif ( 'flags' eq $k ) {
+                    $p->{'flags'} = join( ' ', split( /,/, $v ) );
+                }
+                elsif ( 'colorsuffix' eq $k ) {
+                    $p->{'bits'} |= 1 if ($v);
+                }
+                else {
+                    fail( $file, $ln, "Unknown profile key '$k'" );
+                }
+            } ## end foreach my $t (@tok)
+            exists $pindex{ $p->{'name'} }
+                and fail( $file, $ln, "Duplicate profile '$p->{name}'" );
+            $pindex{ $p->{'name'} } = scalar @profiles;
+            push @profiles, $p;
+        } ## end elsif ( 'profile' eq $kind)
+        elsif ( 'match' eq $kind ) {
+            my $name = pop @tok;
+            exists $pindex{$name}
+                or fail( $file, $ln, "Unknown profile '$name'" );
+            my %f = ();
+            foreach my $t (@tok) {
+                $t =~ m/^(da1|da2|da3|enq)([=~])(.*)$/
+                    or fail( $file, $ln, "Bad match field '$t'" );
+                my ( $field, $op, $val ) = ( $1, $2, $3 );
+                if ( '~' eq $op ) {
+                    ( 'da1' eq $field || 'da2' eq $field )
+                        or fail( $file, $ln, "No class form for $field" );
+                    $f{$field} = [ $FIELD{$field} . '~'
+                                   . normal_class( $field, $val ) ];
+                } else {
+                    $f{$field} = [ map { $FIELD{$field} . '=' . $_ }
+                                   expand_digits( unescape($val) ) ];
+                }
+            } ## end foreach my $t (@tok)
+            my @keys = ( q{} );
+            foreach my $field ( qw{ da1 da2 da3 enq } ) {
+                next unless ( exists $f{$field} );
+                @keys = map {
+                    my $k = $_;
+                    map { length($k) ? "$k\037$_" : $_ } @{ $f{$field} }
+                } @keys;
+            }
+            foreach my $key (@keys) {
+                exists $seen{$key}
+                    and fail( $file, $ln, "Duplicate match, see line "
+                                          . $seen{$key} );
+                $seen{$key} = $ln;
+                push @matches, { 'key' => $key,
+                                 'profile' => $pindex{$name} };
+            }
+        } ## end elsif ( 'match' eq $kind)
+        else {
+            fail( $file, $ln, "Unknown line type '$kind'" );
+        }
+    } ## end while ( my $line = readline...)
+    close($fh);
+
+    return ( $serial, \@profiles, \@matches );
+} ## end sub read_source
+
+sub fnv1a
+{
+    my $h = 0x811c9dc5;
+    foreach my $c ( unpack( 'C*', shift ) ) {
+        $h = ( ( $h ^ $c ) * 0x01000193 ) & 0xffffffff;
+    }
+    return $h;
+}
+
+sub write_db
+{
+    my ( $dst, $serial, $profiles, $matches ) = @_;
+    my $strings = "\0";
+    my %stroff  = ( q{} => 0 );
+    my $str     = sub {
+        my $s = shift;
+        if ( ! exists $stroff{$s} ) {
+            $stroff{$s} = length($strings);
+            $strings .= $s . "\0";
+        }
+        return $stroff{$s};
+    };
+
+    my $nbuckets = 16;
+    while ( $nbuckets < 2 * scalar @{$matches} ) {
+        $nbuckets *= 2;
+    }
+    my @bucket = map { [ 0, 0 ] } ( 1 .. $nbuckets );
+    my $mdata  = q{};
+    my $ix     = 0;
+    foreach my $m ( @{$matches} ) {
+        my $h = fnv1a( $m->{'key'} );
+        my $b = $h & ( $nbuckets - 1 );
+        while ( $bucket[$b][1] ) {
+            $b = ( $b + 1 ) & ( $nbuckets - 1 );
+        }
+        $bucket[$b] = [ $h, ++$ix ];
+        $mdata .= pack( 'VVV', $str->( $m->{'key'} ), length( $m->{'key'} ),
+                        $m->{'profile'} );
+    }
+    my $pdata = q{};
+    foreach my $p ( @{$profiles} ) {
+        $pdata .= pack( 'VVVVCCCC', $str->( $p->{'name'} ),
+                        $str->( $p->{'terms'} ), $str->( $p->{'flags'} ),
+                        $p->{'colors'} || 0, $p->{'emoji'} || 0,
+                        $p->{'truecolor'} || 0, $p->{'mode'} || 0,
+                        $p->{'bits'} );
+    }
+    my $bdata = join( q{}, map { pack( 'VV', @{$_} ) } @bucket );
+
+    my $hlen  = 8 + ( 10 * 4 );
+    my $off_b = $hlen;
+    my $off_m = $off_b + length($bdata);
+    my $off_p = $off_m + length($mdata);
+    my $off_s = $off_p + length($pdata);
+    my $head  = "TRFPDB\0\0" . pack( 'V10', $FORMAT, $serial, $nbuckets,
+                    scalar @{$matches}, scalar @{$profiles}, $off_b, $off_m,
+                    $off_p, $off_s, length($strings) );
+
+    my $fh = undef;
+    open( $fh, '>:raw', "$dst.tmp" )
+        or fail( $dst, 0, "Unable to open: $OS_ERROR" );
+    print $fh $head, $bdata, $mdata, $pdata, $strings;
+    close($fh) or fail( $dst, 0, "Unable to write: $OS_ERROR" );
+    rename( "$dst.tmp", $dst )
+        or fail( $dst, 0, "Unable to rename: $OS_ERROR" );
+} ## end sub write_db
+
+# EOF generate_fpdb.pl
@@ -35,6 +35,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <termios.h>
@@ -42,12 +43,233 @@
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <poll.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 
 int term_cleanline();
+int hextobin( const unsigned char h );
 void printlicense( void );
+int pcache_load( void );
+int noreply_known( int q );
+void pcache_save( int ix );
+
+/* Reply chunk arrival times kept per query for --stats */
+#define STAT_CHUNKS 64
+/* Bytes after a reply terminator, held for the next read */
+#define CARRY_MAX 256
+
+/* Growable byte buffer */
+struct bytebuf {
+    char   *b;
+    size_t  len;
+    size_t  cap;
+};
+
+void bb_reserve( struct bytebuf *bb, size_t len );
+void bb_put( struct bytebuf *bb, const char *b, size_t len );
+void bb_printf( struct bytebuf *bb, const char *fmt, ... );
+size_t print_compile( int opts, struct bytebuf *bb, const char *src,
+                      size_t len );
+
+/* print_compile() opts */
+#define NO_NEWLINE 0x2
+#define INTERPRET_ESC 0x4
+
+/***************************************
+ * One line of a --record file.
+ * .kind :
+ * 'Q' Bytes written as a query
+ * 'W' Any other bytes written (line erase)
+ * 'L' Reader started listening (no bytes)
+ * 'R' Bytes read back
+ */
+struct rec_s {
+    char       kind;
+    long long  t;
+    size_t     len;
+    char      *b;
+};
+
+/* Queries whose raw replies are kept for --identify */
+enum query_e {
+    Q_NONE = 0,
+    Q_ENQ,
+    Q_DA1,
+    Q_DA2,
+    Q_DA3,
+    Q_COLOR,
+    Q_BG,
+    Q_PRINT,
+    Q_MAX
+};
+
+#ifndef FPDB_PATH
+#define FPDB_PATH "/usr/local/share/termread/termread.fpdb"
+#endif
+#define FPDB_MAGIC "TRFPDB\0\0"
+#define FPDB_FORMAT 1
+#define FPDB_HEAD 48
+#define FPDB_COLORSUFFIX 0x1
+/* opt.enc, how replies are written out, see reply_encode() */
+#define ENC_OCTAL  0      /* '...' with \0ooo, the default */
+#define ENC_BASH   1      /* $'...' with \e \xHH, ready to use */
+#define ENC_HEX    2      /* '...' two hex digits a byte */
+#define ENC_RAW    3      /* '...' the bytes themselves */
+#define ENC_MAX    4
+/* opt.init, the shell --init writes for */
+#define INIT_NONE  0
+#define INIT_BASH  1      /* export NAME='value' ... */
+#define INIT_ZSH   2      /* same as bash */
+#define INIT_SH    3      /* NAME='value' ...; export NAME ... */
+
+/* Seconds a query that went unanswered is not asked again */
+#define NOREPLY_TTL ( 7 * 24 * 3600 )
+
+/* Longest reply kept, in bytes as received */
+#define REPLY_MAX  4096
+
+/* demux_s .state, see demux_byte() */
+#define DM_GROUND  0
+#define DM_ESC     1      /* ESC seen */
+#define DM_ESCI    2      /* ESC and intermediates (ESC / Z) */
+#define DM_CSI     3
+#define DM_SS3     4      /* ESC O, keypad and function keys */
+#define DM_STR     5      /* OSC, DCS, APC or PM body */
+#define DM_STR_ESC 6      /* ESC inside one, maybe the ST */
+#define DM_CSI_REP 7      /* CSI with a private marker, a reply */
+#define DM_SEQ     32     /* longest plain CSI kept to be sorted */
+
+/* Multiplexer between termread and the terminal, see mux_wrap() */
+#define MUX_NONE   1
+#define MUX_TMUX   2
+#define MUX_SCREEN 3
+
+/* Quiet time that ends a reply once it has started (us) */
+#define WAIT_FOR_MORE 10000
+
+/* Round trip assumed by the probe planner until one is measured (us) */
+#define PLAN_RTT 10000
+
+/* Most round trips one --ping may time */
+#define PING_MAX 10000
+
+/***************************************
+ * termread.fpdb, as mapped.  Built by generate_fpdb.pl from
+ * fingerprints.dat, the layout is described there.
+ */
+struct fpdb_s {
+    const unsigned char *map;
+    size_t               size;
+    uint32_t             serial;
+    uint32_t             nbuckets;
+    uint32_t             nmatch;
+    uint32_t             nprofile;
+    const unsigned char *buckets;
+    const unsigned char *matches;
+    const unsigned char *profiles;
+    const char          *strings;
+    uint32_t             len_strings;
+};
+
+/* One profile record, unpacked */
+struct fprofile_s {
+    const char *name;
+    const char *terms;      /* TERM candidates, space separated */
+    const char *flags;      /* space separated */
+    unsigned    colors;
+    int         emoji;
+    int         truecolor;
+    int         mode;       /* 0 unknown, 1 semi, 2 colon */
+    int         bits;       /* FPDB_COLORSUFFIX */
+};
+
+/* One match key, split into its fields (see generate_fpdb.pl) */
+struct fpkey_s {
+    char        op[Q_MAX];  /* '=', '~' or 0 when the key skips it */
+    const char *val[Q_MAX];
+    size_t      len[Q_MAX];
+    int         profile;
+    int         rank;       /* fp_lookup() order, lowest wins */
+    int         settled;    /* every field it needs has been asked */
+};
+
+/* Sorts reply bytes from typeahead, see demux_byte() */
+struct demux_s {
+    int    state;
+    char   seq[DM_SEQ];
+    size_t len;
+    const char *finals;     /* plain CSI finals a query out now answers with */
+};
+
+/* Replies to a batch of queries, taken one by one, see replies_next() */
+struct replies_s {
+    struct demux_s dm;
+    struct bytebuf rep;             /* the reply just taken */
+    char           chunk[256];
+    size_t         len;
+    size_t         at;              /* next byte of chunk to sort */
+    long long      now;             /* when chunk arrived */
+    long long      deadline;
+};
+
+/* A query as term_next() built it, sent to every --tty device */
+struct ttyq_s {
+    enum query_e   qid;
+    char          *qname;
+    char          *var;
+    struct bytebuf q;
+};
+
+/* One --tty device being probed, see do_ttys() */
+struct ttydev_s {
+    char          *path;
+    int            fd;
+    int            saved;           /* orig must be put back */
+    struct termios orig;
+    int            next;            /* next entry of the shared query list */
+    int            done;
+    enum query_e   qid;
+    char          *qname;
+    char          *var;
+    long long      t_write;
+    long long      t_first;
+    long long      t_last;
+    long long      deadline;
+    int            chunks;
+    struct bytebuf val;             /* encoded reply */
+    struct bytebuf skipped;         /* qnames the --budget skipped */
+    struct bytebuf out;             /* VAR='...' lines, printed at the end */
+    struct demux_s dm;
+    struct bytebuf typeahead;
+    struct bytebuf carry;           /* read past the last reply */
+    struct bytebuf reply[Q_MAX];
+    int            asked[Q_MAX];
+    int            settled;         /* plan_next() had nothing left */
+};
 
 static struct termios orig_term, new_term;
 
+/* --stats=full hot path counters, see cnt_poll() and friends */
+struct counts_s {
+    long read;        /* read(2) calls on the terminal */
+    long write;       /* write(2) calls to it */
+    long poll;        /* poll(2) or epoll_wait(2) calls */
+    long empty;       /* wakeups that brought nothing: timeouts, EAGAIN */
+    long in;          /* bytes read */
+    long out;         /* bytes written */
+    long tcset;       /* tcsetattr(3) calls */
+    long cache;       /* answers taken from the cache */
+};
+
 struct sopt {
     int needhelp;     /* Help is needed */
     int wanthelp;     /* Help is explicitly requested */
@@ -59,21 +281,91 @@ struct sopt {
     int termname;     /* VT* terminal caps query */
     int term2da;
     int term3da;
+    int identify;     /* Match replies against the fingerprint database */
+    int decode;       /* Also print what DA1 and DA2 replies mean */
+    int widths;       /* Measure glyph widths with cursor reports */
+    int rqss;         /* DECRQSS batch */
+    int kbd;          /* Kitty keyboard protocol flags */
+    int no_cache;     /* Don't use cached answers, only refresh them */
+    int pick_term;    /* Print the first candidate TERM with terminfo */
+    int init;         /* INIT_*, one eval-able line for a shell rc */
+    int prefetch;     /* Answer in the background, into the session slot */
+    int collect;      /* Print (waiting if need be) the session slot */
     int print;
     int justerase;    /* VT* terminal current line erase sequence */
     int ignoreterm;   /* Ignore $TERM */
     int wantstat;
+    int stats_full;   /* --stats=full, counters too */
+    struct counts_s cnt;        /* this run so far */
+    struct counts_s cnt_mark;   /* cnt when the current action began */
     int color_num;
     int debug;
     long int delay;
-    long int stat_d_first;
-    long int stat_d_inter;
-    long int stat_d_final;
-    size_t bufsz;
+    long int budget;          /* --budget milliseconds, 0 for none */
+    long long budget_end;     /* when the --budget runs out */
+    long long q_end;          /* latest a reply may start, this query */
+    int       q_skip;         /* term_write() skipped this query */
+    int       q_fence;        /* term_write() sent a DA1 after it */
+    uint32_t  noreply_key[Q_MAX];   /* fp_tuple() when each went out */
+    int       noreply_seen[Q_MAX];  /* planner's query: 1 missed, -1 not */
+    int       plan_stop;      /* --identify ran out of --budget */
+    int       plan_settled;   /* plan_next() found nothing left to ask */
+    int       pcache_ix;      /* profile cache hit: fpdb profile + 1 */
+    int       da1_first;      /* -i with the caches: DA1 before even ENQ */
+    struct bytebuf skipped;   /* qnames the --budget skipped */
+    struct bytebuf picks;     /* --pick-term candidates, space separated */
+    /* All stat_* times are CLOCK_MONOTONIC microseconds */
+    long long stat_t_write;   /* query write started */
+    long long stat_t_listen;  /* reader started listening */
+    long long stat_t_first;   /* first reply chunk arrived */
+    long long stat_t_last;    /* last reply chunk arrived */
+    long long stat_d_w2r;     /* write to first reply byte */
+    long long stat_d_first;   /* listening to first reply byte */
+    long long stat_d_inter;   /* longest gap between reply chunks */
+    long long stat_d_final;   /* write to last reply byte */
+    int       stat_chunks;
+    long long stat_chunk_t[STAT_CHUNKS];
+    size_t    stat_chunk_len[STAT_CHUNKS];
+    int    enc;             /* ENC_ style */
     FILE * termfh;
     char * custom_print;
+    int    print_raw;
+    int    ping;            /* --ping round trips */
+    int    ping_dsr;
+    int    ping_pipe;
+    struct bytebuf print_q;         /* -p compiled, see print_compile() */
+    const char *print_b;            /* -p bytes to send, maybe mmap'd */
+    size_t print_len;
+    size_t print_map;               /* mapped length, 0 if not mapped */
+    char * stats_log;
+    char * fpdb_path;
+    enum query_e qid;
+    struct bytebuf raw;             /* raw bytes of the last reply */
+    struct bytebuf reply[Q_MAX];    /* raw reply to each query sent */
+    int    asked[Q_MAX];
+    long long plan_rtt;     /* slowest answered round trip so far */
+    int    mux;             /* 0 (auto, not yet known) or MUX_* */
+    int    mux_hint;        /* MUX_* guessed from $TERM, needs DA1 proof */
+    int    mux_checked;     /* first DA1 has confirmed (or undone) opt.mux */
+    int    raw_depth;       /* initTermios() calls not yet reset */
+    struct bytebuf typeahead;       /* keys typed while we read replies */
+    struct bytebuf outbuf;          /* results, one write() at exit */
+    struct bytebuf dbgbuf;          /* -v lines, likewise to stderr */
+    int    slot_lock;       /* --prefetch: held until the slot is written */
+    char   slot[PATH_MAX];  /* --prefetch: slot file being written */
+    char * record;
+    char * replay;
+    FILE * recfh;
+    struct rec_s *rec;      /* --replay records */
+    size_t nrec;
+    size_t rec_at;          /* next unplayed record */
+    size_t rec_off;         /* bytes already played from rec[rec_at] */
+    long long rec_q_t;      /* recorded time of the current query */
+    char * qname;
     char * var;
     char * term;
+    char **ttys;            /* --tty devices, probed together */
+    int    nttys;
     char * buf;
     char * envterm;
     char * argv0;
@@ -92,6 +384,7 @@ struct options_s {
     char  *header;
     char  *full[3];
     char  *want;
+    char  *maybe;       /* --full=value allowed, but not needed */
     char  *descr;
     char   indic;
     char  *helptext[3];
@@ -156,11 +449,128 @@ struct options_s {
         .indic = 'p',
         .int_dest = &opt.print,
         .helptext = {
-            "Ask terminal using string.",
+            "Ask terminal using string, @file or - (stdin).",
             "String escapes will be expanded.",
             NULL
         }
     },
+    {
+        .full = { "print-raw", NULL },
+        .ltr  = { 0 },
+        .int_dest = &opt.print_raw,
+        .helptext = {
+            "Send --print bytes as they are, no escapes.",
+            NULL
+        }
+    },
+    {
+        .is_action = 1,
+        .full = { "ping", NULL },
+        .ltr  = { 0 },
+        .want = "count",
+        .descr = "ping",
+        .indic = 'P',
+        .helptext = {
+            "Time count (up to 10000) DA1 round trips: min,",
+            "    median, p99, max and replies per second.",
+            NULL
+        }
+    },
+    {
+        .full = { "ping-dsr", NULL },
+        .ltr  = { 0 },
+        .int_dest = &opt.ping_dsr,
+        .helptext = { "--ping with DSR 5 (status) instead of DA1.", NULL }
+    },
+    {
+        .full = { "ping-pipeline", NULL },
+        .ltr  = { 0 },
+        .int_dest = &opt.ping_pipe,
+        .helptext = {
+            "--ping sends every query at once instead of one",
+            "    at a time, for throughput.",
+            NULL
+        }
+    },
+    {
+        .is_action = 1,
+        .full = { "identify", NULL },
+        .ltr  = { 'i', 0 },
+        .int_dest = &opt.identify,
+        .helptext = {
+            "Ask only what the fingerprint database needs",
+            "    (DA1, DA2, DA3, ENQ) to name the terminal.",
+            NULL
+        }
+    },
+    {
+        .is_action = 1,
+        .full = { "widths", NULL },
+        .ltr  = { 0 },
+        .int_dest = &opt.widths,
+        .helptext = {
+            "Measure how wide emoji, CJK and other glyphs print,",
+            "    once per terminal (DA1 and DA2), then cached.",
+            NULL
+        }
+    },
+    {
+        .is_action = 1,
+        .full = { "rqss", NULL },
+        .ltr  = { 0 },
+        .int_dest = &opt.rqss,
+        .helptext = {
+            "Ask (DECRQSS) SGR with truecolor, cursor style,",
+            "    margins and conformance level in one go.",
+            NULL
+        }
+    },
+    {
+        .is_action = 1,
+        .full = { "kitty-keys", NULL },
+        .ltr  = { 0 },
+        .int_dest = &opt.kbd,
+        .helptext = {
+            "Ask for the kitty keyboard protocol flags (CSI ? u),",
+            "    with a DA1 so a terminal without it costs one trip.",
+            NULL
+        }
+    },
+    {
+        .is_action = 1,
+        .full = { "init", NULL },
+        .ltr  = { 0 },
+        .want = "bash|zsh|sh",
+        .descr = "shell",
+        .indic = 'S',
+        .helptext = {
+            "Identify, then print only TERM, COLORTERM and _TM_*",
+            "    as one line for that shell to eval.",
+            NULL
+        }
+    },
+    {
+        .is_action = 1,
+        .full = { "pick-term", NULL },
+        .ltr  = { 0 },
+        .int_dest = &opt.pick_term,
+        .helptext = {
+            "Print the first of the TERMs after it (or -i's)",
+            "    that has a terminfo entry.",
+            NULL
+        }
+    },
+    {
+        .is_action = 1,
+        .full = { "collect", NULL },
+        .ltr  = { 0 },
+        .int_dest = &opt.collect,
+        .helptext = {
+            "Print what an earlier --prefetch found,",
+            "    waiting for it if it is still asking.",
+            NULL
+        }
+    },
     {
         .control = 'd',
         .is_action = 1,
@@ -182,6 +592,16 @@ struct options_s {
         .ltr  = { '!', 0 },
         .helptext = { "Ignore TERM env, asks as if TERM=xterm.", NULL }
     },
+    {
+        .full = { "prefetch", NULL },
+        .ltr  = { 0 },
+        .int_dest = &opt.prefetch,
+        .helptext = {
+            "Return at once, ask in the background and keep",
+            "    the answers for --collect.",
+            NULL
+        }
+    },
     {
         .full = { "delay", NULL },
         .ltr  = { 'd', 0 },
@@ -194,6 +614,18 @@ struct options_s {
             NULL
         }
     },
+    {
+        .full = { "budget", NULL },
+        .ltr  = { 0 },
+        .want = "ms",
+        .descr = "budget",
+        .indic = 'B',
+        .helptext = {
+            "Milliseconds for all actions together; the least",
+            "    needed are skipped when time runs short.",
+            NULL
+        }
+    },
     {
         .ltr  = { 0 },
         .full = { "var", NULL },
@@ -209,9 +641,105 @@ struct options_s {
     {
         .ltr  = { 's', 0 },
         .full = { "stats", NULL },
+        .maybe = "full",
+        .descr = "stats level",
+        .indic = 'F',
         .int_dest = &opt.wantstat,
         .helptext = {
-            "Print stats info after read response.",
+            "Print stats info after read response.  Times are in",
+            "    microseconds; =full adds syscall and cache counts.",
+            NULL
+        }
+    },
+    {
+        .ltr  = { 0 },
+        .full = { "stats-log", NULL },
+        .want = "file",
+        .descr = "stats log",
+        .indic = 'l',
+        .helptext = {
+            "Append per-query timings to this file, and",
+            "    print p50/p90/p99 across all logged runs.",
+            NULL
+        }
+    },
+    {
+        .ltr  = { 0 },
+        .full = { "db", NULL },
+        .want = "file",
+        .descr = "fingerprint database",
+        .indic = 'D',
+        .helptext = {
+            "Fingerprint database for --identify.",
+            "default: $TERMREAD_DB or termread.fpdb search.",
+            NULL
+        }
+    },
+    {
+        .ltr  = { 0 },
+        .full = { "mux", NULL },
+        .want = "auto|tmux|screen|none",
+        .descr = "multiplexer",
+        .indic = 'm',
+        .helptext = {
+            "Wrap queries so they pass through tmux or screen",
+            "    to the real terminal.  default: auto",
+            NULL
+        }
+    },
+    {
+        .ltr  = { 0 },
+        .full = { "encode", NULL },
+        .want = "octal|bash|hex|raw",
+        .descr = "encoding",
+        .indic = 'n',
+        .helptext = {
+            "How replies are written: '\\033' octal, $'\\e' for bash,",
+            "    hex, or raw bytes.  default: octal",
+            NULL
+        }
+    },
+    {
+        .ltr  = { 0 },
+        .full = { "decode", NULL },
+        .int_dest = &opt.decode,
+        .helptext = {
+            "Also print DA1 features as a bitmask and names,",
+            "    and DA2 as terminal type and version.",
+            NULL
+        }
+    },
+    {
+        .ltr  = { 0 },
+        .full = { "no-cache", NULL },
+        .int_dest = &opt.no_cache,
+        .helptext = {
+            "Ask the terminal even what the cache knows, and wait out",
+            "    every unanswered query (the cache is still updated).",
+            NULL
+        }
+    },
+    {
+        .ltr  = { 0 },
+        .full = { "record", NULL },
+        .want = "file",
+        .descr = "record file",
+        .indic = 'w',
+        .helptext = {
+            "Log every byte written and read, with",
+            "    monotonic timestamps, to this file.",
+            NULL
+        }
+    },
+    {
+        .ltr  = { 0 },
+        .full = { "replay", NULL },
+        .want = "file",
+        .descr = "replay file",
+        .indic = 'y',
+        .helptext = {
+            "Answer the requested actions from a --record",
+            "    file instead of a terminal.",
             NULL
         }
     },
@@ -225,15 +753,14 @@ struct options_s {
         }
     },
     {
-        .control = 'd',
         .ltr  = { 'o', 0 },
         .full = { "tty", NULL },
         .want = "/dev/tt...",
         .descr = "device name",
         .indic = 'o',
         .helptext = {
-            "Open this instead of current stdin/stdout.",
-            "Probably won't work.",
+            "Probe this device instead of stdin, repeat to probe",
+            "    many at once (output is grouped per device).",
             NULL
         }
     },
@@ -307,12 +834,71 @@ const char xt_eraseline[] = "\033[9D\033[2K";
 
 #define DEBUGOUT(str, ... ) if ( opt.debug ) \
     { \
-        char *b = calloc(1024, 1); \
-        sprintf( b, "# DEBUG: %s", str );\
-        fprintf( stderr, b, __VA_ARGS__ ); \
-        free(b); \
+        bb_printf( &opt.dbgbuf, "# DEBUG: " str, __VA_ARGS__ ); \
     };
 
+/* Results go to opt.outbuf, see out_flush() */
+#define OUTPUT( ... ) bb_printf( &opt.outbuf, __VA_ARGS__ )
+
+/* Microseconds from a clock that is never stepped */
+long long
+mono_us(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ( (long long)ts.tv_sec * 1000000LL ) + ( ts.tv_nsec / 1000 );
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ( (long long)tv.tv_sec * 1000000LL ) + tv.tv_usec;
+#endif
+}
+
+/* poll(2), counted for --stats=full; a timeout is an empty wakeup */
+int
+cnt_poll( struct pollfd *pfd, nfds_t n, int timeout_ms )
+{
+    int ret = poll( pfd, n, timeout_ms );
+    opt.cnt.poll++;
+    opt.cnt.empty += ( 0 == ret );
+    return ret;
+}
+
+/* read(2), counted; nothing read is an empty wakeup */
+ssize_t
+cnt_read( int fd, void *b, size_t len )
+{
+    ssize_t ret = read( fd, b, len );
+    opt.cnt.read++;
+    if ( 0 < ret ) {
+        opt.cnt.in += ret;
+    } else {
+        opt.cnt.empty++;
+    }
+    return ret;
+}
+
+/* write(2), counted */
+ssize_t
+cnt_write( int fd, const void *b, size_t len )
+{
+    ssize_t ret = write( fd, b, len );
+    opt.cnt.write++;
+    if ( 0 < ret ) {
+        opt.cnt.out += ret;
+    }
+    return ret;
+}
+
+/* tcsetattr(3), counted */
+int
+cnt_tcsetattr( int fd, int act, const struct termios *t )
+{
+    opt.cnt.tcset++;
+    return tcsetattr( fd, act, t );
+}
+
 void
 prinversion(void)
 {
@@ -873,6 +1459,7 @@ _arg_valid( int index, char *val )
     //       they were all moved here instead.
     int   getcolor = 0;
     int   getdelay = 0;
+    long  count    = 0;
 
     switch(indic) {
         case 'p':
@@ -893,8 +1480,9 @@ _arg_valid( int index, char *val )
                         Options[index].full[0] )
                     );
             break;
-        case 'o':
-            opt.term = val;
+        case 'l':
+            opt.stats_log = val;
+            opt.wantstat = 1;
             DEBUGOUT("Value '%s' for %s is set\n",
                     val,
                     ( Options[index].descr?
@@ -902,48 +1490,179 @@ _arg_valid( int index, char *val )
                         Options[index].full[0] )
                     );
             break;
-        case 'c':
-            getcolor = strtol( val, &endptr, 10 );
-            if (   ( endptr != val )
-                && ( endptr - val == strlen(val) )  )
-            {
-                opt.getcolor = 1;
-                opt.color_num = getcolor;
-                DEBUGOUT("--color [%i] ACTION requested.\n", opt.color_num);
+        case 'D':
+            opt.fpdb_path = val;
+            DEBUGOUT("Value '%s' for %s is set\n",
+                    val,
+                    ( Options[index].descr?
+                        Options[index].descr:
+                        Options[index].full[0] )
+                    );
+            break;
+        case 'm':
+            if ( 0 == strcmp( val, "tmux" ) ) {
+                opt.mux = MUX_TMUX;
+            } else if ( 0 == strcmp( val, "screen" ) ) {
+                opt.mux = MUX_SCREEN;
+            } else if ( 0 == strcmp( val, "none" ) ) {
+                opt.mux = MUX_NONE;
+            } else if ( 0 == strcmp( val, "auto" ) ) {
+                opt.mux = 0;
             } else {
                 opt.needhelp = 1;
                 return 1;
             }
+            /* Told, so no need to prove it */
+            opt.mux_checked = ( 0 != opt.mux );
+            DEBUGOUT("Value '%s' for %s is set\n",
+                    val,
+                    ( Options[index].descr?
+                        Options[index].descr:
+                        Options[index].full[0] )
+                    );
             break;
-        case 'd':
-            endptr = NULL;
-            getdelay = strtol( val, &endptr, 10 );
-            if (   ( endptr != val )
-                && ( endptr - val == strlen(val) )  )
-            {
-                if ( 0 >= getdelay ) {
-                    opt.needhelp = 1;
-                    return 1;
-                } else {
-                    opt.delay = getdelay;
-                    DEBUGOUT("--delay [%li].\n", opt.delay);
-                }
+        case 'n':
+            if ( 0 == strcmp( val, "octal" ) ) {
+                opt.enc = ENC_OCTAL;
+            } else if ( 0 == strcmp( val, "bash" ) ) {
+                opt.enc = ENC_BASH;
+            } else if ( 0 == strcmp( val, "hex" ) ) {
+                opt.enc = ENC_HEX;
+            } else if ( 0 == strcmp( val, "raw" ) ) {
+                opt.enc = ENC_RAW;
+            } else {
+                opt.needhelp = 1;
+                return 1;
             }
+            DEBUGOUT("Value '%s' for %s is set\n",
+                    val,
+                    ( Options[index].descr?
+                        Options[index].descr:
+                        Options[index].full[0] )
+                    );
             break;
-        default:
-            return 1;
-    }
-    return 0;
-}
-
-void
-prinhelp(void)
-{
-    FILE *out = stderr;
-    if ( opt.wanthelp ) {
-        out = stdout;
-    }
-    fprintf( out, IDENT " Version " VERSION "\n\n" );
+        case 'S':
+            if ( 0 == strcmp( val, "bash" ) ) {
+                opt.init = INIT_BASH;
+            } else if ( 0 == strcmp( val, "zsh" ) ) {
+                opt.init = INIT_ZSH;
+            } else if ( 0 == strcmp( val, "sh" ) ) {
+                opt.init = INIT_SH;
+            } else {
+                opt.needhelp = 1;
+                return 1;
+            }
+            opt.identify  = 1;
+            DEBUGOUT("Value '%s' for %s is set\n",
+                    val,
+                    ( Options[index].descr?
+                        Options[index].descr:
+                        Options[index].full[0] )
+                    );
+            break;
+        case 'w':
+            opt.record = val;
+            DEBUGOUT("Value '%s' for %s is set\n",
+                    val,
+                    ( Options[index].descr?
+                        Options[index].descr:
+                        Options[index].full[0] )
+                    );
+            break;
+        case 'y':
+            opt.replay = val;
+            DEBUGOUT("Value '%s' for %s is set\n",
+                    val,
+                    ( Options[index].descr?
+                        Options[index].descr:
+                        Options[index].full[0] )
+                    );
+            break;
+        case 'o':
+            opt.ttys = realloc( opt.ttys, ( opt.nttys + 1 ) * sizeof(char *) );
+            if ( NULL == opt.ttys ) {
+                fprintf(stderr, "%s\n", strerror(errno) );
+                exit ( 1 );
+            }
+            opt.ttys[opt.nttys++] = val;
+            DEBUGOUT("Value '%s' for %s is set\n",
+                    val,
+                    ( Options[index].descr?
+                        Options[index].descr:
+                        Options[index].full[0] )
+                    );
+            break;
+        case 'c':
+            getcolor = strtol( val, &endptr, 10 );
+            if (   ( endptr != val )
+                && ( endptr - val == strlen(val) )  )
+            {
+                opt.getcolor = 1;
+                opt.color_num = getcolor;
+                DEBUGOUT("--color [%i] ACTION requested.\n", opt.color_num);
+            } else {
+                opt.needhelp = 1;
+                return 1;
+            }
+            break;
+        case 'd':
+            endptr = NULL;
+            getdelay = strtol( val, &endptr, 10 );
+            if (   ( endptr != val )
+                && ( endptr - val == strlen(val) )  )
+            {
+                if ( 0 >= getdelay ) {
+                    opt.needhelp = 1;
+                    return 1;
+                } else {
+                    opt.delay = getdelay;
+                    DEBUGOUT("--delay [%li].\n", opt.delay);
+                }
+            }
+            break;
+        case 'F':
+            if ( strcmp( val, Options[index].maybe ) ) {
+                opt.needhelp = 1;
+                return 1;
+            }
+            opt.stats_full = 1;
+            DEBUGOUT("--stats=%s requested.\n", val);
+            break;
+        case 'P':
+            endptr = NULL;
+            count  = strtol( val, &endptr, 10 );
+            if (   ( endptr == val ) || ( *endptr ) || ( 0 >= count )
+                || ( PING_MAX < count ) )
+            {
+                opt.needhelp = 1;
+                return 1;
+            }
+            opt.ping = (int)count;
+            DEBUGOUT("--ping [%i] ACTION requested.\n", opt.ping);
+            break;
+        case 'B':
+            endptr = NULL;
+            opt.budget = strtol( val, &endptr, 10 );
+            if ( ( endptr == val ) || ( *endptr ) || ( 0 >= opt.budget ) ) {
+                opt.needhelp = 1;
+                return 1;
+            }
+            DEBUGOUT("--budget [%li].\n", opt.budget);
+            break;
+        default:
+            return 1;
+    }
+    return 0;
+}
+
+void
+prinhelp(void)
+{
+    FILE *out = stderr;
+    if ( opt.wanthelp ) {
+        out = stdout;
+    }
+    fprintf( out, IDENT " Version " VERSION "\n\n" );
     fprintf( out, "Copyright (c) " C_YEARS ", by\n" AUTHORS "\n" );
     prinusage();
     fprintf( out, "\nQueries Terminal for various settings.\n" );
@@ -991,6 +1710,10 @@ prinhelp(void)
                     fprintf( out, "    --%s <%s>\n",
                             Options[cx].full[dx],
                             Options[cx].want );
+                } else if ( Options[cx].maybe ) {
+                    fprintf( out, "    --%s[=%s]\n",
+                            Options[cx].full[dx],
+                            Options[cx].maybe );
                 } else {
                     fprintf( out, "    --%s\n", Options[cx].full[dx] );
                 }
@@ -1112,6 +1835,87 @@ shift_ch( char *arry, long max )
     return( ret );
 }
 
+/***************************************
+ * Get the -p bytes ready, once: a string, @file or - for stdin.  A
+ * file sent with --print-raw is mapped and written from the mapping,
+ * never copied; otherwise escapes are compiled into opt.print_q.  With
+ * the payload on stdin, the terminal is reopened there for replies.
+ */
+void
+print_load()
+{
+    const char *src = opt.custom_print;
+    size_t      len = strlen( src );
+    struct bytebuf in = { NULL, 0, 0 };
+
+    if ( '@' == src[0] ) {
+        struct stat st;
+        int fd = open( src + 1, O_RDONLY );
+        if ( ( 0 > fd ) || ( 0 != fstat( fd, &st ) ) ) {
+            fprintf( stderr, "Unable to open '%s': %s\n", src + 1,
+                    strerror(errno) );
+            exit( 1 );
+        }
+        len = st.st_size;
+        src = "";
+        if ( len ) {
+            src = mmap( NULL, len, PROT_READ, MAP_PRIVATE, fd, 0 );
+            if ( MAP_FAILED == src ) {
+                fprintf( stderr, "Unable to map '%s': %s\n",
+                        opt.custom_print + 1, strerror(errno) );
+                exit( 1 );
+            }
+            opt.print_map = len;
+        }
+        close( fd );
+        DEBUGOUT("--print from '%s', %zu bytes\n", opt.custom_print + 1, len );
+    }
+    else if ( 0 == strcmp( src, "-" ) ) {
+        char    chunk[4096];
+        ssize_t got;
+        while ( 0 != ( got = read( STDIN_FILENO, chunk, sizeof(chunk) ) ) ) {
+            if ( 0 > got ) {
+                if ( EINTR == errno ) {
+                    continue;
+                }
+                fprintf( stderr, "Unable to read stdin: %s\n",
+                        strerror(errno) );
+                exit( 1 );
+            }
+            bb_put( &in, chunk, got );
+        }
+        src = in.b ? in.b : "";
+        len = in.len;
+        DEBUGOUT("--print from stdin, %zu bytes\n", len );
+        if ( NULL == opt.replay ) {
+            int fd = open( "/dev/tty", O_RDWR|O_NOCTTY );
+            if ( ( 0 > fd ) || ( 0 > dup2( fd, STDIN_FILENO ) ) ) {
+                fprintf( stderr, "--print - needs a terminal to read "
+                        "replies from: %s\n", strerror(errno) );
+                exit( 1 );
+            }
+            close( fd );
+            opt.term = ttyname( STDIN_FILENO );
+        }
+    }
+
+    opt.print_q.len = 0;
+    if ( opt.print_raw && opt.print_map ) {
+        opt.print_b   = src;
+        opt.print_len = len;
+        return;
+    }
+    print_compile( opt.print_raw ? 0 : INTERPRET_ESC, &opt.print_q, src,
+                   len );
+    if ( opt.print_map ) {
+        munmap( (void *)src, opt.print_map );
+        opt.print_map = 0;
+    }
+    free( in.b );
+    opt.print_b   = opt.print_q.b ? opt.print_q.b : "";
+    opt.print_len = opt.print_q.len;
+}
+
 int
 args( int argc, char *argv[] )
 {
@@ -1120,6 +1924,9 @@ args( int argc, char *argv[] )
     /* Default all options */
     struct sopt* memopt = &opt;
     memset( memopt, 0, sizeof(struct sopt) );
+    /* Room enough that -v and a run of actions never reallocate */
+    bb_reserve( &opt.dbgbuf, 4096 );
+    bb_reserve( &opt.outbuf, 4096 );
     opt.envterm = getenv("TERM");
     opt.argv0   = argv[0];
     opt.term    = ttyname(STDIN_FILENO);
@@ -1193,6 +2000,14 @@ args( int argc, char *argv[] )
                         }
                     }
                 }
+                else if ( Options[found].maybe ) {
+                    char * eq  = index(argv[cx], '=');
+                    if ( eq && _arg_valid( found, eq + 1 ) ) {
+                        fprintf(stderr,
+                                "Not a valid %s '%s' for option '%s'\n",
+                                Options[found].descr, eq + 1, argv[cx] );
+                    }
+                }
             } else {
                 fprintf( stderr, "Unknown option %d: [%s]\n", cx, argv[cx] );
                 opt.needhelp = 1;
@@ -1252,6 +2067,10 @@ args( int argc, char *argv[] )
                         argv[from_arg]
                     );
             }
+        } else if ( opt.pick_term ) {
+            /* Every other argument is a TERM candidate */
+            bb_printf( &opt.picks, "%s%s", opt.picks.len ? " " : "",
+                    argv[cx] );
         } else {
             fprintf( stderr, "Unknown option %d: [%s]\n", cx, argv[cx] );
             opt.needhelp = 1;
@@ -1285,6 +2104,19 @@ args( int argc, char *argv[] )
         opt.delay = 500;      /* ~ 500 milliseconds or 0.5 seconds */
         DEBUGOUT("--delay defaulting to [%li]\n", opt.delay);
     }
+    if ( opt.stats_full ) {
+        opt.wantstat = 1;
+    }
+    if ( opt.widths ) {
+        /* The fingerprint the width table is cached under */
+        opt.termname = 1;
+        opt.term2da  = 1;
+    }
+    if ( opt.identify && ! ( opt.no_cache || opt.record || opt.replay ) ) {
+        /* The caches are filed under the DA1 reply, so it goes first */
+        opt.termname  = 1;
+        opt.da1_first = 1;
+    }
     /* Warn about no action */
     if ( 0 == action_requested ) {
         fprintf( stderr, "No ACTION requested.\n");
@@ -1318,18 +2150,49 @@ args( int argc, char *argv[] )
             DEBUGOUT("--var [%s] will only be used for --printf\n", opt.var );
         }
     }
+    /* --tty runs every device at once, some actions can't */
+    if ( opt.nttys && ( opt.widths || opt.rqss || opt.kbd || opt.init ) ) {
+        fprintf( stderr, "--widths, --rqss, --kitty-keys and --init work on "
+                "one terminal, not with --tty.\n");
+        opt.needhelp = 1;
+    }
+    else if ( opt.nttys && ( opt.record || opt.replay ) ) {
+        fprintf( stderr, "--record and --replay work on one terminal, "
+                "not with --tty.\n");
+        opt.needhelp = 1;
+    }
+    /* --ping times its own queries, nothing else may interleave */
+    if ( opt.ping && ( ( 1 < action_requested ) || opt.nttys ) ) {
+        fprintf( stderr, "--ping is the only action of its run.\n");
+        opt.needhelp = 1;
+    }
+    else if ( opt.ping && opt.prefetch ) {
+        fprintf( stderr, "--ping times this terminal now, not with "
+                "--prefetch.\n");
+        opt.needhelp = 1;
+    }
+    /* Only now, so --help with a missing @file still helps */
+    if (   opt.custom_print
+        && ! ( opt.needhelp || opt.wanthelp || opt.wantversion
+               || opt.wantlicense ) )
+    {
+        print_load();
+    }
     return 1;
 }
 
 void
 initTermios(int echo)
 {
+    if ( opt.replay || ( 0 < opt.raw_depth++ ) ) {
+        return;
+    }
     fcntl(0, F_SETFL, O_NONBLOCK);
     tcgetattr(0, &orig_term);      /* grab original terminal i/o settings */
     new_term = orig_term;  /* make new settings same as original settings */
     new_term.c_lflag &= ~ICANON;                  /* disable buffered i/o */
     new_term.c_lflag &= echo ? ECHO : ~ECHO;             /* set echo mode */
-    int ret = tcsetattr(0, TCSANOW, &new_term);
+    int ret = cnt_tcsetattr(0, TCSANOW, &new_term);
     if ( -1 == ret ) {
         fprintf(stderr, "Unable to set terminal attributes: %s\n",
             strerror(errno) );
@@ -1341,7 +2204,10 @@ initTermios(int echo)
 void
 resetTermios(void)
 {
-    int ret = tcsetattr(0, TCSANOW, &orig_term);
+    if ( opt.replay || ( 0 < --opt.raw_depth ) ) {
+        return;
+    }
+    int ret = cnt_tcsetattr(0, TCSANOW, &orig_term);
     if ( -1 == ret ) {
         fprintf(stderr, "Unable to reset terminal attributes: %s\n",
             strerror(errno) );
@@ -1353,6 +2219,260 @@ resetTermios(void)
     }
 }
 
+/* Room for len more bytes and the NUL */
+void
+bb_reserve( struct bytebuf *bb, size_t len )
+{
+    if ( bb->len + len + 1 > bb->cap ) {
+        size_t cap = bb->cap ? bb->cap : 256;
+        while ( bb->len + len + 1 > cap ) {
+            cap *= 2;
+        }
+        bb->b = realloc( bb->b, cap );
+        if ( NULL == bb->b ) {
+            fprintf(stderr, "%s\n", strerror(errno) );
+            exit ( 1 );
+        }
+        bb->cap = cap;
+    }
+}
+
+void
+bb_put( struct bytebuf *bb, const char *b, size_t len )
+{
+    bb_reserve( bb, len );
+    memcpy( bb->b + bb->len, b, len );
+    bb->len += len;
+    bb->b[bb->len] = 0;
+}
+
+void
+bb_putc( struct bytebuf *bb, int c )
+{
+    char ch = c;
+    bb_put( bb, &ch, 1 );
+}
+
+void
+bb_printf( struct bytebuf *bb, const char *fmt, ... )
+{
+    va_list ap;
+    int     len;
+
+    /* Straight into the spare room, again only if it didn't fit */
+    bb_reserve( bb, 0 );
+    va_start( ap, fmt );
+    len = vsnprintf( bb->b + bb->len, bb->cap - bb->len, fmt, ap );
+    va_end( ap );
+    if ( 0 > len ) {
+        bb->b[bb->len] = 0;
+        return;
+    }
+    if ( bb->len + len + 1 > bb->cap ) {
+        bb_reserve( bb, len );
+        va_start( ap, fmt );
+        vsnprintf( bb->b + bb->len, bb->cap - bb->len, fmt, ap );
+        va_end( ap );
+    }
+    bb->len += len;
+}
+
+/* Write all of bb to fd and empty it */
+void
+bb_drain( struct bytebuf *bb, int fd )
+{
+    size_t off = 0;
+
+    while ( off < bb->len ) {
+        ssize_t wr = write( fd, bb->b + off, bb->len - off );
+        if ( 0 > wr ) {
+            if ( EINTR == errno ) {
+                continue;
+            }
+            break;
+        }
+        off += wr;
+    }
+    bb->len = 0;
+}
+
+/***************************************
+ * Everything termread has to say goes out here, -v lines then the
+ * results, a write(2) each however many actions there were.  Runs
+ * from atexit() too, so an error exit still shows what came before.
+ */
+void
+out_flush(void)
+{
+    bb_drain( &opt.dbgbuf, STDERR_FILENO );
+    bb_drain( &opt.outbuf, STDOUT_FILENO );
+}
+
+/***************************************
+ * --record line: KIND MONOTONIC_US HEXBYTES
+ */
+void
+rec_line( char kind, long long t, const char *b, size_t len )
+{
+    static const char hex[] = "0123456789abcdef";
+    if ( NULL == opt.recfh ) {
+        return;
+    }
+    fprintf( opt.recfh, "%c %lld ", kind, t );
+    for ( size_t cx = 0; cx < len; cx++ ) {
+        putc( hex[ ( b[cx] >> 4 ) & 0xf ], opt.recfh );
+        putc( hex[ b[cx] & 0xf ], opt.recfh );
+    }
+    putc( '\n', opt.recfh );
+}
+
+void
+rec_open()
+{
+    opt.recfh = fopen( opt.record, "w" );
+    if ( NULL == opt.recfh ) {
+        fprintf( stderr, "Unable to open '%s': %s\n",
+            opt.record, strerror(errno) );
+        exit(1);
+    }
+    fprintf( opt.recfh, "# " IDENT " " VERSION " record\n" );
+    fprintf( opt.recfh, "# TERM=%s\n", opt.envterm );
+}
+
+/***************************************
+ * Load a --record file whole, so replies can be handed to
+ * readInput() at memory speed with no terminal attached.
+ */
+void
+replay_load()
+{
+    FILE *fh = fopen( opt.replay, "r" );
+    if ( NULL == fh ) {
+        fprintf( stderr, "Unable to open '%s': %s\n",
+            opt.replay, strerror(errno) );
+        exit(1);
+    }
+    char   *line = NULL;
+    size_t  linecap = 0;
+    size_t  max = 0;
+    ssize_t ln;
+    while ( 0 < ( ln = getline( &line, &linecap, fh ) ) ) {
+        char      kind = 0;
+        long long t    = 0;
+        int       at   = 0;
+        if ( '#' == line[0] ) {
+            if ( ( 0 == strncmp( line, "# TERM=", 7 ) )
+              && ( ! opt.ignoreterm ) )
+            {
+                line[ strcspn( line, "\n" ) ] = 0;
+                opt.envterm = strdup( line + 7 );
+                DEBUGOUT("--replay TERM [%s]\n", opt.envterm );
+            }
+            continue;
+        }
+        if ( 2 > sscanf( line, "%c %lld %n", &kind, &t, &at ) ) {
+            continue;
+        }
+        if ( opt.nrec == max ) {
+            max = max ? ( max * 2 ) : 64;
+            opt.rec = realloc( opt.rec, max * sizeof(struct rec_s) );
+            if ( NULL == opt.rec ) {
+                fprintf(stderr, "%s\n", strerror(errno) );
+                exit ( 1 );
+            }
+        }
+        struct rec_s *r = &opt.rec[opt.nrec++];
+        r->kind = kind;
+        r->t    = t;
+        r->len  = 0;
+        r->b    = malloc( ( ln / 2 ) + 1 );
+        if ( NULL == r->b ) {
+            fprintf(stderr, "%s\n", strerror(errno) );
+            exit ( 1 );
+        }
+        for ( char *h = line + at; isxdigit( h[0] ) && isxdigit( h[1] );
+                h += 2 )
+        {
+            r->b[r->len++] = ( hextobin( h[0] ) << 4 ) | hextobin( h[1] );
+        }
+    }
+    free( line );
+    fclose( fh );
+    DEBUGOUT("--replay loaded %zu records\n", opt.nrec );
+}
+
+/***************************************
+ * Move the replay to just past the recorded query matching this one,
+ * skipping any the recording asked that this run does not.  With no
+ * match, just the next recorded query.
+ */
+void
+replay_query( const char *b, size_t len )
+{
+    for ( size_t cx = opt.rec_at; cx < opt.nrec; cx++ ) {
+        struct rec_s *r = &opt.rec[cx];
+        if (   ( 'Q' == r->kind ) && ( len == r->len )
+            && ( 0 == memcmp( b, r->b, len ) ) )
+        {
+            opt.rec_at = cx;
+            break;
+        }
+    }
+    while ( opt.rec_at < opt.nrec ) {
+        struct rec_s *r = &opt.rec[opt.rec_at++];
+        if ( 'Q' == r->kind ) {
+            opt.rec_q_t = r->t;
+            opt.rec_off = 0;
+            if ( ( len != r->len ) || ( memcmp( b, r->b, len ) ) ) {
+                DEBUGOUT("--replay query differs from recorded query%s\n",
+                        "" );
+            }
+            return;
+        }
+    }
+    DEBUGOUT("--replay has no more recorded queries%s\n", "" );
+}
+
+/***************************************
+ * Hand back the next recorded reply chunk for the current query,
+ * with its arrival time shifted onto this run's clock.
+ * Returns 0 once the next query (or the deadline) is reached.
+ */
+size_t
+replay_chunk( char *chunk, size_t max, long long deadline, long long *now )
+{
+    while ( opt.rec_at < opt.nrec ) {
+        struct rec_s *r = &opt.rec[opt.rec_at];
+        if ( 'Q' == r->kind ) {
+            return 0;
+        }
+        else if ( 'R' != r->kind ) {
+            opt.rec_at++;
+            continue;
+        }
+        long long t = opt.stat_t_write + ( r->t - opt.rec_q_t );
+        if ( t < opt.stat_t_listen ) {
+            t = opt.stat_t_listen;
+        }
+        if ( t >= deadline ) {
+            return 0;
+        }
+        size_t len = r->len - opt.rec_off;
+        if ( len > max ) {
+            len = max;
+        }
+        memcpy( chunk, r->b + opt.rec_off, len );
+        opt.rec_off += len;
+        if ( opt.rec_off >= r->len ) {
+            opt.rec_at++;
+            opt.rec_off = 0;
+        }
+        *now = t;
+        return len;
+    }
+    return 0;
+}
+
 int
 term_open()
 {
@@ -1394,28 +2514,196 @@ term_close()
     return 0;
 }
 
-int
-term_cleanline()
+/***************************************
+ * Pick the multiplexer, unless --mux said: $TMUX means tmux, $STY
+ * means screen.  Without either (over ssh from inside one, say) a
+ * $TERM of tmux* or screen* is only a hint, taken up if the first DA1
+ * comes back as the multiplexer's own answer (see mux_check()).
+ */
+void
+mux_detect()
 {
-    FILE * fh;
-    if (term_open()) {
-        fh = opt.termfh;
-    } else {
-        return 0;
-    }
+    char *env;
+    char *term = getenv("TERM");
 
-    int ret = 0;
-    if ( 0 == is_vtxx( opt.envterm ) ) {
-        ret = fprintf(fh, vt_eraseline );
-    } else {
-        ret = fprintf(fh, xt_eraseline );
+    if ( opt.mux ) {
+        return;
     }
-    fflush( fh );
-    return ret;
+    opt.mux = MUX_NONE;
+    if ( opt.replay ) {
+        return;
+    }
+    if ( ( env = getenv("TMUX") ) && ( env[0] ) ) {
+        opt.mux = MUX_TMUX;
+    }
+    else if ( ( env = getenv("STY") ) && ( env[0] ) ) {
+        opt.mux = MUX_SCREEN;
+    }
+    else if ( term && ( 0 == strncmp( term, "tmux", 4 ) ) ) {
+        opt.mux_hint = MUX_TMUX;
+    }
+    else if ( term && ( 0 == strncmp( term, "screen", 6 ) ) ) {
+        opt.mux_hint = MUX_SCREEN;
+    }
+    DEBUGOUT("mux %d, hint %d\n", opt.mux, opt.mux_hint );
 }
 
-int
-hextobin ( const unsigned char h )
+/***************************************
+ * Wrap a query in the multiplexer's passthrough envelope.
+ * tmux (3.3+ needs `set -g allow-passthrough on`):
+ *   ESC P tmux; <query, each ESC doubled> ESC \
+ * screen passes a DCS body on as is, but it ends at the first ST, so
+ * an ST inside the query is sent as BEL instead:
+ *   ESC P <query> ESC \
+ */
+void
+mux_wrap( const char *b, size_t len, struct bytebuf *out )
+{
+    out->len = 0;
+    if ( MUX_TMUX == opt.mux ) {
+        bb_put( out, "\033Ptmux;", 7 );
+        for ( size_t cx = 0; cx < len; cx++ ) {
+            if ( 033 == b[cx] ) {
+                bb_putc( out, 033 );
+            }
+            bb_putc( out, b[cx] );
+        }
+    }
+    else {
+        bb_put( out, "\033P", 2 );
+        for ( size_t cx = 0; cx < len; cx++ ) {
+            if ( ( 033 == b[cx] ) && ( cx + 1 < len ) && ( '\\' == b[cx + 1] ) ) {
+                bb_putc( out, 007 );
+                cx++;
+                continue;
+            }
+            bb_putc( out, b[cx] );
+        }
+    }
+    bb_put( out, "\033\\", 2 );
+}
+
+/***************************************
+ * Undo a tmux envelope around a reply, should one come back wrapped.
+ * Returns 1 if raw was changed.
+ */
+int
+mux_unwrap( struct bytebuf *raw )
+{
+    size_t out = 0;
+
+    if (   ( 9 > raw->len )
+        || ( 0 != memcmp( raw->b, "\033Ptmux;", 7 ) )
+        || ( 0 != memcmp( raw->b + raw->len - 2, "\033\\", 2 ) ) )
+    {
+        return 0;
+    }
+    for ( size_t cx = 7; cx < raw->len - 2; cx++ ) {
+        raw->b[out++] = raw->b[cx];
+        if ( ( 033 == raw->b[cx] ) && ( 033 == raw->b[cx + 1] ) ) {
+            cx++;
+        }
+    }
+    raw->len = out;
+    raw->b[out] = 0;
+    return 1;
+}
+
+/***************************************
+ * After the first DA1, check the multiplexer guess against the reply.
+ * A wrapped DA1 that got nothing back means passthrough is off, so go
+ * back to asking the multiplexer itself.  An unwrapped DA1 answered
+ * with the multiplexer's own "\033[?1;2c" while $TERM hinted at one
+ * means try again, wrapped.  Returns 1 if DA1 should be asked again.
+ */
+int
+mux_check()
+{
+    if ( opt.mux_checked || ( Q_DA1 != opt.qid ) ) {
+        return 0;
+    }
+    opt.mux_checked = 1;
+    if ( ( MUX_NONE < opt.mux ) && ( 0 == opt.raw.len ) ) {
+        DEBUGOUT("No reply through the %s passthrough, asking it directly\n",
+                ( MUX_TMUX == opt.mux ) ? "tmux" : "screen" );
+        opt.mux = MUX_NONE;
+        return 1;
+    }
+    if (   ( MUX_NONE == opt.mux ) && opt.mux_hint
+        && ( 7 == opt.raw.len )
+        && ( 0 == memcmp( opt.raw.b, "\033[?1;2c", 7 ) ) )
+    {
+        DEBUGOUT("DA1 looks like the multiplexer's, trying passthrough%s\n",
+                "" );
+        opt.mux = opt.mux_hint;
+        opt.mux_hint = 0;
+        opt.mux_checked = 0;
+        return 1;
+    }
+    return 0;
+}
+
+/***************************************
+ * Every byte for the terminal goes through here.
+ * `query` marks bytes expecting a reply (for --record/--replay).
+ */
+int
+term_send( const char *b, size_t len, int query )
+{
+    long long t = mono_us();
+    if ( query ) {
+        opt.stat_t_write = t;
+    }
+    if ( opt.replay ) {
+        if ( query ) {
+            replay_query( b, len );
+        }
+        return len;
+    }
+    if ( ! term_open() ) {
+        return 0;
+    }
+
+    /* Recorded as the caller built it, the way --replay compares it */
+    struct bytebuf wrapped = { NULL, 0, 0 };
+    const char *w    = b;
+    size_t      wlen = len;
+    if ( query && ( MUX_NONE < opt.mux ) ) {
+        mux_wrap( b, len, &wrapped );
+        w    = wrapped.b;
+        wlen = wrapped.len;
+    }
+    size_t    off = 0;
+    while ( off < wlen ) {
+        ssize_t wr = cnt_write( fileno( opt.termfh ), w + off, wlen - off );
+        if ( 0 > wr ) {
+            if ( ( EINTR == errno ) || ( EAGAIN == errno ) ) {
+                continue;
+            }
+            break;
+        }
+        off += wr;
+    }
+    if ( w != b ) {
+        /* Part of a wrapped query is none of the caller's */
+        off = ( off == wlen ) ? len : 0;
+    }
+    rec_line( ( query ? 'Q' : 'W' ), t, b, off );
+    free( wrapped.b );
+    return off;
+}
+
+int
+term_cleanline()
+{
+    if ( 0 == is_vtxx( opt.envterm ) ) {
+        return term_send( vt_eraseline, strlen( vt_eraseline ), 0 );
+    }
+    return term_send( xt_eraseline, strlen( xt_eraseline ), 0 );
+}
+
+int
+hextobin ( const unsigned char h )
 {
     switch ( h )
     { /* No break, everything returns */
@@ -1461,170 +2749,101 @@ hextobin ( const unsigned char h )
     return 0;
 }
 
-#define NO_NEWLINE 0x2
-#define INTERPRET_ESC 0x4
+/***************************************
+ * Compile -p text once into the bytes to send, in bb: \\ \a \b \e \f
+ * \n \r \t \v, \xH[H] and \0[ooo] (a value of 0 is dropped), any other
+ * backslash is kept as is.  One pass, plain runs copied whole.
+ * Returns the number of bytes added.
+ */
+size_t
+print_compile( int opts, struct bytebuf *bb, const char *src, size_t len )
+{
+    static const char simple[] = "\\\\a\007b\010e\033f\014n\012r\015t\011v\013";
+    size_t start = bb->len;
+    size_t cx    = 0;
 
-int
-doprint( int opts, FILE *fh, char* out )
-{
-    int buildval = 0;
-    int retval = 0;
-    for ( int cx = 0; cx < strlen( out ); cx++ ) {
-        if ( opts & INTERPRET_ESC ) {
-            if ( '\\' == out[cx] ) {
-                if ( 0 == sncmp ( "\\\\", &out[cx], 2 ) ) {
-                    putc('\\', fh);
-                    retval++;
-                    cx++;
-                }
-                else if ( 0 == sncmp ( "\\a", &out[cx], 2 ) ) { // BEL
-                    putc(7, fh);
-                    retval++;
-                    cx++;
-                }
-                else if ( 0 == sncmp ( "\\b", &out[cx], 2 ) ) { // BS
-                    putc(8, fh);
-                    retval++;
-                    cx++;
-                }
-                else if ( 0 == sncmp ( "\\e", &out[cx], 2 ) ) { // ESC
-                    /* Escape Character */
-                    putc( 0x1b , fh);
-                    retval++;
-                    cx++;
-                }
-                else if ( 0 == sncmp ( "\\f", &out[cx], 2 ) ) { // FF
-                    putc( 0x0c , fh);
-                    retval++;
-                    cx++;
-                }
-                else if ( 0 == sncmp ( "\\n", &out[cx], 2 ) ) { // NL
-                    putc( 0x0a , fh);
-                    retval++;
-                    cx++;
-                }
-                else if ( 0 == sncmp ( "\\r", &out[cx], 2 ) ) { // CR
-                    putc( 0x0d , fh);
-                    retval++;
-                    cx++;
-                }
-                else if ( 0 == sncmp ( "\\t", &out[cx], 2 ) ) { // HT
-                    putc( '\t' , fh);
-                    retval++;
-                    cx++;
-                }
-                else if ( 0 == sncmp ( "\\v", &out[cx], 2 ) ) { // VT
-                    putc( 0x0b , fh);
-                    retval++;
-                    cx++;
-                }
-                else if ( 0 == sncmp ( "\\x", &out[cx], 2 ) ) { // HEX
-                    if ( isxdigit( out[cx+2] ) ) {
-                        if ( isxdigit( out[cx+3] ) ) {
-                            buildval = 16 * hextobin( out[cx+2] );
-#ifdef DEBUG
-    DEBUGOUT( "HEX BUILD pos 1: '%c', Now: %d \\x%02x \\0%03o\n",
-            out[cx+2], buildval, buildval, buildval );
-#endif
-                            buildval = buildval + hextobin( out[cx+3] );
-#ifdef DEBUG
-    DEBUGOUT( "HEX BUILD pos 2: '%c', Final: %d \\x%02x \\0%03o\n",
-            out[cx+2], buildval, buildval, buildval );
-#endif
-                            cx = cx + 3;
-                        } else {
-                            buildval = hextobin( out[cx+2] );
-#ifdef DEBUG
-    DEBUGOUT( "HEX BUILD pos 1: '%c', Final: %d \\x%02x \\0%03o\n",
-            out[cx+2], buildval, buildval, buildval );
-#endif
-                            cx = cx + 2;
-                        }
-                        if ( buildval ) {
-                            putc( buildval , fh);
-                            retval++;
-                        }
-                        buildval = 0;
-                    } else {
-#ifdef DEBUG
-    fprintf( stderr, "HEX ABORT on 'no hexadecimal digit'.\n");
-#endif
-                        putc( '\\' , fh);
-                        retval++;
-                    }
-                }
-                else if ( 0 == sncmp ( "\\0", &out[cx], 2 ) ) { // OCTAL
-                    if ( '0' <= out[cx+2] && '7' >= out[cx+2] ) {
-                        cx++;
-                        for ( int dx = 0; dx < 3; dx++ ) {
-                            if ( '0' <= out[cx+1] && '7' >= out[cx+1] ) {
-                                buildval =
-                                    (buildval * 8) + hextobin( out[cx+1] );
-#ifdef DEBUG
-    fprintf( stderr, "OCTAL BUILD pos %d: '%c', Now: %d \\x%02x \\0%03o\n",
-            dx, out[cx+1], buildval, buildval, buildval );
-#endif
-                                cx++;
-                            } else {
-#ifdef DEBUG
-    fprintf( stderr, "OCTAL STOP pos %d: '%c', Final: %d \\x%02x \\0%03o\n",
-            dx, out[cx+1], buildval, buildval, buildval );
-#endif
-                                dx=3;
-                            }
-                        }
-                        if ( buildval ) {
-                            putc( buildval , fh);
-                            retval++;
-                        }
-                        buildval = 0;
-                    } else {
-#ifdef DEBUG
-    fprintf( stderr, "OCTAL ABORT on 'no octal digit'.\n");
-#endif
-                        putc( '\\' , fh);
-                        retval++;
-                    }
-                } else {
-                    putc( '\\' , fh);
-                    retval++;
-                }
-            } else {
-                putc( out[cx] , fh);
-                retval++;
+    if ( 0 == ( opts & INTERPRET_ESC ) ) {
+        bb_put( bb, src, len );
+        return len;
+    }
+    bb_reserve( bb, len );
+    while ( cx < len ) {
+        const char *bs  = memchr( src + cx, '\\', len - cx );
+        size_t      run = bs ? (size_t)( bs - src ) - cx : len - cx;
+        bb_put( bb, src + cx, run );
+        cx += run;
+        if ( cx >= len ) {
+            break;
+        }
+        /* src[cx] is a backslash */
+        char        nx  = ( cx + 1 < len ) ? src[cx + 1] : 0;
+        const char *sx  = nx ? memchr( simple, nx, sizeof(simple) - 1 ) : NULL;
+        int         val = 0;
+        int         dig = 0;
+
+        if ( sx && ( 0 == ( ( sx - simple ) & 1 ) ) ) {
+            bb_putc( bb, sx[1] );
+            cx += 2;
+        }
+        else if ( ( 'x' == nx ) && ( cx + 2 < len )
+               && isxdigit( (unsigned char)src[cx + 2] ) )
+        {
+            for ( cx += 2; ( dig < 2 ) && ( cx < len )
+                    && isxdigit( (unsigned char)src[cx] ); dig++, cx++ )
+            {
+                val = ( val * 16 ) + hextobin( src[cx] );
             }
-        } else {
-            putc( out[cx] , fh);
-            retval++;
+            if ( val ) {
+                bb_putc( bb, val );
+            }
+        }
+        else if ( ( '0' == nx ) && ( cx + 2 < len )
+               && ( '0' <= src[cx + 2] ) && ( '7' >= src[cx + 2] ) )
+        {
+            for ( cx += 2; ( dig < 3 ) && ( cx < len )
+                    && ( '0' <= src[cx] ) && ( '7' >= src[cx] ); dig++, cx++ )
+            {
+                val = ( val * 8 ) + ( src[cx] - '0' );
+            }
+            if ( val ) {
+                bb_putc( bb, val );
+            }
+        }
+        else {
+            bb_putc( bb, '\\' );
+            cx++;
         }
     }
-    fflush( fh );
-    return retval;
+    return bb->len - start;
 }
 
+/***************************************
+ * Take the next requested action, set opt.qname, opt.qid and the
+ * default opt.var for it, and build its query bytes into q (left
+ * empty when the TERM can't do it).  Returns 0 when no action is left.
+ */
 int
-term_write()
+term_next( struct bytebuf *q )
 {
-    FILE * fh;
-    if (term_open()) {
-        fh = opt.termfh;
-    } else {
-        return 0;
-    }
+    int ret = 1;
+    char qbuf[64];
 
-    int ret = 0;
-    if ( 1 == opt.reqenq ) {
+    q->len = 0;
+    if ( ( 1 == opt.reqenq ) && ! ( opt.da1_first && opt.termname ) ) {
         opt.reqenq = 0;
+        opt.qname = "enq";
+        opt.qid   = Q_ENQ;
         if ( NULL == opt.var ) {
             opt.var = enq_var;
             DEBUGOUT("Set default --enq var to %s\n", opt.var );
         }
         // Unlike many of these, ENQUIRY doesn't need any ECMA check
-        ret = fprintf(fh, ENQUIRY);
-        fflush( fh );
+        bb_put( q, ENQUIRY, strlen( ENQUIRY ) );
     }
     else if ( 1 == opt.termname ) {
         opt.termname = 0;
+        opt.qname = "term";
+        opt.qid   = Q_DA1;
         if ( NULL == opt.var ) {
             opt.var = termname_var;
             DEBUGOUT("Set default --term var to %s\n", opt.var );
@@ -1632,28 +2851,28 @@ term_write()
 
         if ( 0 == is_vtxx( opt.envterm ) ) {
             // THIS IS VERY RARE, WILL PROBABLY NEVER BE USED...
-            ret = fprintf(fh, DEC_ID );
+            bb_put( q, DEC_ID, strlen( DEC_ID ) );
         }
         else if ( 0 == is_vtxxx( opt.envterm ) ) {
-            ret = fprintf(fh, PRIMARY_DEV_ATTR );
+            bb_put( q, PRIMARY_DEV_ATTR, strlen( PRIMARY_DEV_ATTR ) );
         } else {
             fprintf( stderr,
                 "# Current effective TERM='%s', does not support --term\n",
                 opt.envterm );
             exit(1);
         }
-        fflush( fh );
     }
     else if ( 1 == opt.term2da ) {
         opt.term2da = 0;
+        opt.qname = "term2";
+        opt.qid   = Q_DA2;
         if ( NULL == opt.var ) {
             opt.var = term2da_var;
             DEBUGOUT("Set default --term2 var to %s\n", opt.var );
         }
 
         if ( 0 == is_vtxxx( opt.envterm ) ) {
-            ret = fprintf(fh, xt_term2da);
-            fflush( fh );
+            bb_put( q, xt_term2da, strlen( xt_term2da ) );
         } else {
             fprintf( stderr,
                 "# Current effective TERM='%s', does not support --term2\n",
@@ -1666,14 +2885,15 @@ term_write()
     }
     else if ( 1 == opt.term3da ) {
         opt.term3da = 0;
+        opt.qname = "term3";
+        opt.qid   = Q_DA3;
         if ( NULL == opt.var ) {
             opt.var = term3da_var;
             DEBUGOUT("Set default --term2 var to %s\n", opt.var );
         }
 
         if ( 0 == is_vtxxx( opt.envterm ) ) {
-            ret = fprintf(fh, xt_term3da);
-            fflush( fh );
+            bb_put( q, xt_term3da, strlen( xt_term3da ) );
         } else {
             fprintf( stderr,
                 "# Current effective TERM='%s', does not support --term3\n",
@@ -1686,14 +2906,16 @@ term_write()
     }
     else if ( 1 == opt.getcolor ) {
         opt.getcolor = 0;
+        opt.qname = "color";
+        opt.qid   = Q_COLOR;
         if ( NULL == opt.var ) {
             opt.var = getcolor_var;
             DEBUGOUT("Set default --color var to %s\n", opt.var );
         }
 
         if ( 0 == is_vtxxx( opt.envterm ) ) {
-            ret = fprintf(fh, xt_colorreq, opt.color_num);
-            fflush( fh );
+            snprintf( qbuf, sizeof(qbuf), xt_colorreq, opt.color_num );
+            bb_put( q, qbuf, strlen( qbuf ) );
         } else {
             fprintf( stderr,
                 "# Current effective TERM='%s', does not support --color\n",
@@ -1706,14 +2928,15 @@ term_write()
     }
     else if ( 1 == opt.background ) {
         opt.background = 0;
+        opt.qname = "bg";
+        opt.qid   = Q_BG;
         if ( NULL == opt.var ) {
             opt.var = background_var;
             DEBUGOUT("Set default --bg var to %s\n", opt.var );
         }
 
         if ( 0 == is_vtxxx( opt.envterm ) ) {
-            ret = fprintf(fh, xt_colorbg );
-            fflush( fh );
+            bb_put( q, xt_colorbg, strlen( xt_colorbg ) );
         } else {
             fprintf( stderr,
                 "# Current effective TERM='%s', does not support --bg\n",
@@ -1726,201 +2949,3574 @@ term_write()
     }
     else if ( 1 == opt.print ) {
         opt.print = 0;
+        opt.qname = "print";
+        opt.qid   = Q_PRINT;
         if ( NULL == opt.var ) {
             opt.var = print_var;
             DEBUGOUT("Set default --printf var to %s\n", opt.var );
         }
-        doprint( INTERPRET_ESC | NO_NEWLINE, fh, opt.custom_print );
+        /* Sent straight from opt.print_b by term_write(), no copy */
     }
     else {
-        if ( 0 == is_vtxx( opt.envterm ) ) {
-            ret = fprintf(fh, vt_eraseline );
-        } else {
-            ret = fprintf(fh, xt_eraseline );
-        }
-        fflush( fh );
+        ret = 0;
     }
     return ret;
 }
 
+/* --budget: lower ranks are asked first when time is short */
 int
-readInput( int bufsz, char * buf )
+budget_rank( enum query_e q )
 {
-    if ( 0 == bufsz ) {
-        if ( opt.bufsz ) {
-            bufsz = opt.bufsz;
-        }
-        else {
-            bufsz = 80;
-            if ( buf ) {
-                free( buf );
-                buf = opt.buf;
-            }
-        }
+    switch ( q ) {
+        case Q_DA1:   return 0;
+        case Q_DA2:   return 1;
+        case Q_PRINT: return 2;     /* asked for by name */
+        case Q_BG:    return 3;
+        case Q_COLOR: return 4;
+        case Q_DA3:   return 5;
+        default:      return 6;     /* ENQ, often never answered */
     }
-    if ( NULL == buf ) {
-        if ( opt.buf ) {
-            buf = opt.buf;
-        } else {
-            buf = calloc( bufsz, 1 );
-            if ( NULL == buf ) {
-                fprintf(stderr, "%s\n", strerror(errno) );
-                exit ( 1 );
-            }
-        }
-    } else {
-        memset( buf, 0, bufsz );
-    }
-    opt.bufsz = bufsz;
-    opt.buf = buf;
-    char     c;
-    size_t   bufln          = 0;
-    int      first          = 0;
-    long int wait_for_first = ( 2 * opt.delay );
-    /* Translates to ~ 10 milliseconds or 0.01 seconds ...                */
-    long int wait_for_more  = 20;
-    long int cur_wait       = wait_for_first;
-    long int delay          = 0;
-    int      ret            = 0;
+}
 
-    initTermios(0);
-    while (cur_wait > delay) {
-        ret = read(0, &c, 1);
-        if ( 1 == ret ) {
-            if ( 0 == first ) {
-                first = 1;
-                opt.stat_d_first = delay;
-                cur_wait = wait_for_more;
-            } else if ( delay > opt.stat_d_inter ) {
-                opt.stat_d_inter = delay;
-            }
-            delay = 0;
-            if ( 0x20 > c ) {
-                if ( 3 == c ) {
-                    // ETX: End of Text
-                    break;
-                }
-                else if ( 4 == c ) {
-                    // EOT: End of Transmission
-                    break;
-                }
-                else if ( 10 == c ) {
-                    // LF: Line Feed
-                    break;
-                }
-                else if ( 16 == c ) {
-                    // DLE: Data Link Escape
-                    break;
-                }
-                else if ( 23 == c ) {
-                    // ETB: End Transmission Block
-                    break;
-                }
-                else {
-                    char oct_c[10];
-                    snprintf(oct_c, 10, "\\0%o", c);
-                    for ( int cx = 0; cx < strlen(oct_c); cx++ ) {
-                        buf[bufln++] = oct_c[cx];
-                    }
-                }
-            } else {
-                buf[bufln++] = c;
-                c = 0;
-            }
-            if ( bufsz <= (bufln + 1) ) {
-                break;
-            }
-        } else {
-            delay++;
-            usleep(500);          /* 0.000 500 of a second */
-            // nanosleep(500000); /* 0.000 500 000 of a second */
+/***************************************
+ * May query q (just taken by term_next()) go out under --budget?  It
+ * must leave a round trip each for the more needed actions still to
+ * come (--identify's DA1 among them), and while there are any it only
+ * gets an even share of what is left to wait in.  opt.q_end is set to
+ * when its reply has to have started.  A skipped query is added to
+ * opt.skipped.
+ */
+int
+budget_allows( enum query_e q )
+{
+    long long rtt  = opt.plan_rtt ? opt.plan_rtt : PLAN_RTT;
+    long long now  = mono_us();
+    int       n_hi = 0;
+    int       n    = 1;
+    struct { int want; enum query_e q; } pend[] = {
+        { opt.reqenq, Q_ENQ },     { opt.termname, Q_DA1 },
+        { opt.term2da, Q_DA2 },    { opt.term3da, Q_DA3 },
+        { opt.getcolor, Q_COLOR }, { opt.background, Q_BG },
+        { opt.print, Q_PRINT },
+    };
+
+    opt.q_end = 0;
+    if ( 0 == opt.budget ) {
+        return 1;
+    }
+    for ( int cx = 0; cx < sizeof(pend) / sizeof(pend[0]); cx++ ) {
+        if ( pend[cx].want ) {
+            n++;
+            n_hi += ( budget_rank( pend[cx].q ) < budget_rank( q ) );
         }
     }
-    resetTermios();
-    opt.stat_d_final = delay;
-    return ( bufln );
+    if (   opt.identify && ( ! opt.plan_stop ) && ( ! opt.asked[Q_DA1] )
+        && ( ! opt.termname ) && ( Q_DA1 != q ) )
+    {
+        n++;
+        n_hi++;
+    }
+    opt.q_end = opt.budget_end - ( n_hi * rtt );
+    if ( n_hi && ( now + ( ( opt.budget_end - now ) / n ) < opt.q_end ) ) {
+        opt.q_end = now + ( ( opt.budget_end - now ) / n );
+    }
+    if ( opt.q_end - now >= rtt ) {
+        return 1;
+    }
+    DEBUGOUT("--budget: skipping %s, %lld us left\n", opt.qname,
+            opt.budget_end - now );
+    bb_printf( &opt.skipped, "%s%s", opt.skipped.len ? " " : "", opt.qname );
+    return 0;
 }
 
+/* Send the next action's query, or erase the line when none is left */
 int
-do_term()
+term_write()
 {
-    int bsz = 1024;
-    char *in;
-    long int got = 0;
+    struct bytebuf q = { NULL, 0, 0 };
+    int ret = 0;
 
-    in = calloc( bsz, 1 );
-    if ( NULL == in ) {
-        exit ( 1 );
+    if ( 0 == term_next( &q ) ) {
+        ret = term_cleanline();
+    }
+    else if ( ! budget_allows( opt.qid ) ) {
+        opt.q_skip = 1;
     }
+    else if ( Q_PRINT == opt.qid ) {
+        if ( opt.print_len ) {
+            ret = term_send( opt.print_b, opt.print_len, 1 );
+        }
+    }
+    else if ( q.len ) {
+        if ( noreply_known( opt.qid ) ) {
+            bb_put( &q, PRIMARY_DEV_ATTR, strlen( PRIMARY_DEV_ATTR ) );
+            opt.q_fence = 1;
+        }
+        ret = term_send( q.b, q.len, 1 );
+    }
+    free( q.b );
+    return ret;
+}
 
-    while (   opt.termname
-            + opt.background
-            + opt.getcolor
-            + opt.term2da
-            + opt.term3da
-            + opt.print )
-    {
-        term_write();
+#define SWAR_ONES  0x0101010101010101ULL
+#define SWAR_HIGH  0x8080808080808080ULL
 
-        got = readInput(bsz, in);
+/* High bit set in each byte of x that is below n (n <= 128), or more */
+#define SWAR_LESS( x, n ) \
+    ( ( (x) - SWAR_ONES * (n) ) & ~(x) & SWAR_HIGH )
+/* ... that equals c */
+#define SWAR_EQ( x, c ) SWAR_LESS( (x) ^ ( SWAR_ONES * (c) ), 1 )
 
-        term_cleanline();
+/* Bytes of b before the first control byte, 8 at a time */
+size_t
+ctl_span( const char *b, size_t len )
+{
+    size_t cx = 0;
 
-        if ( got ) {
-            printf( "%s='%s'; export %s; \n", opt.var, in, opt.var );
+    for ( ; cx + 8 <= len; cx += 8 ) {
+        uint64_t x;
+        memcpy( &x, b + cx, 8 );
+        if ( SWAR_LESS( x, 0x20 ) ) {
+            break;
         }
-        opt.var = NULL;
+    }
+    while ( ( cx < len ) && ( 0x20 <= (unsigned char)b[cx] ) ) {
+        cx++;
+    }
+    return cx;
+}
 
-        if ( opt.wantstat ) {
-            printf("#### STATS \n" );
-            printf("# length : %ld", got );
-            if ( got ) {
-                printf(", first_delay : %.3f s",
-                        ((float)opt.stat_d_first/2000) );
-            }
-            if ( opt.stat_d_inter ) {
-                printf(", longest interchar delay : %.3f s",
-                    ((float)opt.stat_d_inter/2000) );
-            }
-            printf("\n" );
-            if ( opt.debug ) {
-                printf("# tty : %s\n", opt.term );
-            }
+/***************************************
+ * Take reply bytes from chunk into raw, up to limit bytes.  Sets
+ * *done to 1 after a terminator (ETX, EOT, LF, DLE, ETB), which is not
+ * kept, or 2 once raw holds limit bytes.  Returns how many bytes of
+ * chunk were used.
+ */
+size_t
+reply_take( const char *chunk, size_t got, struct bytebuf *raw,
+            size_t limit, int *done )
+{
+    size_t room = ( raw->len < limit ) ? limit - raw->len : 0;
+    size_t n    = ( got < room ) ? got : room;
+    size_t cx   = 0;
+
+    while ( cx < n ) {
+        cx += ctl_span( chunk + cx, n - cx );
+        if ( cx == n ) {
+            break;
+        }
+        char c = chunk[cx];
+        if (   ( 3 == c )     // ETX: End of Text
+            || ( 4 == c )     // EOT: End of Transmission
+            || ( 10 == c )    // LF: Line Feed
+            || ( 16 == c )    // DLE: Data Link Escape
+            || ( 23 == c ) )  // ETB: End Transmission Block
+        {
+            bb_put( raw, chunk, cx );
+            *done = 1;
+            return cx + 1;
         }
+        cx++;
     }
+    bb_put( raw, chunk, n );
+    if ( limit <= raw->len ) {
+        *done = 2;
+    }
+    return n;
+}
 
-    term_close();
+/* Each byte as each ENC_ style writes it, [0] is the length */
+static char enc_tab[ENC_MAX][256][8];
 
-    return 0;
+void
+enc_init(void)
+{
+    static const char hex[] = "0123456789abcdef";
+    static const char named[] = "\033e\007a\010b\011t\012n\015r";
+
+    for ( int c = 0; c < 256; c++ ) {
+        char *o = enc_tab[ENC_OCTAL][c];
+        char *b = enc_tab[ENC_BASH][c];
+        char *h = enc_tab[ENC_HEX][c];
+        char *r = enc_tab[ENC_RAW][c];
+
+        if ( ( 0x20 > c ) || ( 0x7f == c ) || ( '\'' == c ) ) {
+            o[0] = snprintf( &o[1], 7, "\\0%o", c );
+        } else {
+            o[0] = 1; o[1] = c;
+        }
+        if ( ( 0x20 > c ) || ( 0x7f == c ) ) {
+            const char *nx = memchr( named, c, sizeof(named) - 1 );
+            if ( nx && ( 0 == ( ( nx - named ) & 1 ) ) ) {
+                b[0] = 2; b[1] = '\\'; b[2] = nx[1];
+            } else {
+                b[0] = 4; b[1] = '\\'; b[2] = 'x';
+                b[3] = hex[c >> 4]; b[4] = hex[c & 0xf];
+            }
+        } else if ( ( '\'' == c ) || ( '\\' == c ) ) {
+            b[0] = 2; b[1] = '\\'; b[2] = c;
+        } else {
+            b[0] = 1; b[1] = c;
+        }
+        h[0] = 2; h[1] = hex[c >> 4]; h[2] = hex[c & 0xf];
+        if ( '\'' == c ) {
+            memcpy( r, "\004'\\''", 5 );
+        } else {
+            r[0] = 1; r[1] = c;
+        }
+    }
 }
 
-int
-main( int argc, char *argv[], char *env[] )
+/***************************************
+ * Append reply b, quoted for the shell, in style enc (ENC_).  Runs of
+ * bytes that stand for themselves are found 8 at a time and copied
+ * whole, the rest come from enc_tab.
+ */
+void
+reply_encode( struct bytebuf *out, const char *b, size_t len, int enc )
 {
-    args( argc, argv );
+    static int ready = 0;
+    size_t     cx    = 0;
 
-    if ( opt.wanthelp ) {
-        prinhelp();
-        exit( 0 );
-    }
-    else if ( opt.needhelp ) {
-        prinusage();
-        exit( 1 );
-    }
-    else if ( opt.wantlicense ) {
-        printlicense();
-        exit( 0 );
+    if ( ! ready ) {
+        enc_init();
+        ready = 1;
     }
-    else if ( opt.wantversion ) {
-        prinversion();
-        exit( 0 );
+    bb_reserve( out, ( len * 5 ) + 3 );
+    if ( ENC_BASH == enc ) {
+        out->b[out->len++] = '$';
     }
-    else if ( opt.justerase ) {
-        term_cleanline();
-        exit( 0 );
+    out->b[out->len++] = '\'';
+    while ( cx < len ) {
+        size_t run = cx;
+        if ( ENC_HEX != enc ) {
+            for ( ; run + 8 <= len; run += 8 ) {
+                uint64_t x;
+                memcpy( &x, b + run, 8 );
+                if (   SWAR_LESS( x, 0x20 ) || SWAR_EQ( x, 0x7f )
+                    || SWAR_EQ( x, '\'' ) || SWAR_EQ( x, '\\' ) )
+                {
+                    break;
+                }
+            }
+            while ( ( run < len )
+                 && ( 1 == enc_tab[enc][(unsigned char)b[run]][0] ) )
+            {
+                run++;
+            }
+            memcpy( out->b + out->len, b + cx, run - cx );
+            out->len += run - cx;
+        }
+        if ( run < len ) {
+            const char *e = enc_tab[enc][(unsigned char)b[run]];
+            memcpy( out->b + out->len, e + 1, e[0] );
+            out->len += e[0];
+            run++;
+        }
+        cx = run;
     }
+    out->b[out->len++] = '\'';
+    out->b[out->len] = 0;
+}
 
-    do_term();
+/***************************************
+ * Sort one byte read while waiting on a reply into the reply (rep) or
+ * what the user typed meanwhile (ta), by ECMA-48 sequence shape.
+ * Replies: OSC, DCS, APC and PM strings, DECID's ESC / Z, CSI with a
+ * private marker (? > =), and CSI ending in one of dm->finals, set by
+ * whoever sent a query answered that way (R for a cursor report, n for
+ * DSR); keys end in those too, Shift-F3 is CSI 1;2R.  Typeahead: plain
+ * text, other CSI (cursor, function keys, paste brackets, SGR mouse
+ * with <), SS3 keys and ESC + key (Alt).
+ */
+void
+demux_byte( struct demux_s *dm, char c, struct bytebuf *rep,
+            struct bytebuf *ta )
+{
+    switch ( dm->state ) {
+        case DM_ESC:
+            if ( '[' == c ) {
+                dm->seq[dm->len++] = c;
+                dm->state = DM_CSI;
+            }
+            else if ( ( ']' == c ) || ( 'P' == c ) || ( '_' == c )
+                   || ( '^' == c ) )
+            {
+                bb_putc( rep, 033 );
+                bb_putc( rep, c );
+                dm->state = DM_STR;
+            }
+            else if ( 'O' == c ) {
+                dm->seq[dm->len++] = c;
+                dm->state = DM_SS3;
+            }
+            else if ( ( 0x20 <= c ) && ( 0x2f >= c ) ) {
+                dm->seq[dm->len++] = c;
+                dm->state = DM_ESCI;
+            }
+            else if ( 033 == c ) {
+                /* The first ESC was the Escape key */
+                bb_putc( ta, 033 );
+            }
+            else {
+                bb_putc( ta, 033 );
+                bb_putc( ta, c );
+                dm->state = DM_GROUND;
+            }
+            return;
+        case DM_ESCI:
+            dm->seq[dm->len++] = c;
+            if ( ( 0x20 <= c ) && ( 0x2f >= c ) && ( DM_SEQ > dm->len ) ) {
+                return;
+            }
+            bb_put( ( '/' == dm->seq[1] ) ? rep : ta, dm->seq, dm->len );
+            dm->state = DM_GROUND;
+            return;
+        case DM_SS3:
+            dm->seq[dm->len++] = c;
+            bb_put( ta, dm->seq, dm->len );
+            dm->state = DM_GROUND;
+            return;
+        case DM_CSI:
+            dm->seq[dm->len++] = c;
+            if ( ( 3 == dm->len ) && c && memchr( "?>=", c, 3 ) ) {
+                /* Keys never carry these, no need to wait for the end */
+                bb_put( rep, dm->seq, dm->len );
+                dm->state = DM_CSI_REP;
+                return;
+            }
+            if ( ( ( 0x40 > c ) || ( 0x7e < c ) ) && ( DM_SEQ > dm->len ) ) {
+                return;
+            }
+            bb_put( ( c && dm->finals && strchr( dm->finals, c ) ) ? rep : ta,
+                    dm->seq, dm->len );
+            dm->state = DM_GROUND;
+            return;
+        case DM_CSI_REP:
+            bb_putc( rep, c );
+            if ( ( 0x40 <= c ) && ( 0x7e >= c ) ) {
+                dm->state = DM_GROUND;
+            }
+            return;
+        case DM_STR:
+            bb_putc( rep, c );
+            if ( 033 == c ) {
+                dm->state = DM_STR_ESC;
+            } else if ( 007 == c ) {
+                dm->state = DM_GROUND;
+            }
+            return;
+        case DM_STR_ESC:
+            bb_putc( rep, c );
+            dm->state = ( '\\' == c ) ? DM_GROUND : DM_STR;
+            return;
+    }
+    if ( 033 == c ) {
+        dm->seq[0] = c;
+        dm->len = 1;
+        dm->state = DM_ESC;
+    } else {
+        bb_putc( ta, c );
+    }
+}
+
+/* End of a reply window, a sequence cut short is the user's */
+void
+demux_flush( struct demux_s *dm, struct bytebuf *ta )
+{
+    if ( ( DM_ESC <= dm->state ) && ( DM_SS3 >= dm->state ) ) {
+        bb_put( ta, dm->seq, dm->len );
+    }
+    dm->state = DM_GROUND;
+    dm->len = 0;
+}
+
+/***************************************
+ * Hand back what the user typed while replies were being read: into
+ * the tty input queue with TIOCSTI where that is still allowed (Linux
+ * 6.2+ may refuse it, see sysctl dev.tty.legacy_tiocsti, and it never
+ * works on a tty that isn't ours), else as TERMREAD_TYPEAHEAD in the
+ * output, \0ooo escaped like the replies, for the shell to use.
+ */
+void
+typeahead_handoff( int fd, struct bytebuf *ta, struct bytebuf *out )
+{
+    size_t cx = 0;
+
+    if ( 0 == ta->len ) {
+        return;
+    }
+    if ( ! opt.replay ) {
+        while (   ( cx < ta->len )
+               && ( 0 == ioctl( fd, TIOCSTI, &ta->b[cx] ) ) )
+        {
+            cx++;
+        }
+    }
+    DEBUGOUT("typeahead %zu bytes, %zu given back with TIOCSTI\n",
+            ta->len, cx );
+    if ( cx < ta->len ) {
+        bb_printf( out, "TERMREAD_TYPEAHEAD='" );
+        for ( ; cx < ta->len; cx++ ) {
+            unsigned char c = ta->b[cx];
+            if ( ( 0x20 > c ) || ( 0x7f <= c ) || ( '\'' == c )
+                || ( '\\' == c ) )
+            {
+                bb_printf( out, "\\0%o", c );
+            } else {
+                bb_putc( out, c );
+            }
+        }
+        bb_printf( out, "'; export TERMREAD_TYPEAHEAD; \n" );
+    }
+    ta->len = 0;
+}
+
+int
+readInput(void)
+{
+    char     chunk[256];
+    int      done           = 0;
+    long long now           = 0;
+    /* Wait for first char, then ~ 10 milliseconds for each next chunk */
+    long long wait_for_more = WAIT_FOR_MORE;
+    long long deadline      = 0;
+    int      ret            = 0;
+    static char   carry[CARRY_MAX];
+    static size_t carry_len = 0;
+    static long long carry_t = 0;
+    /* ENQ answerback and -p replies are free text, taken as they come */
+    int      demux          = ( Q_ENQ != opt.qid ) && ( Q_PRINT != opt.qid );
+    struct demux_s dm       = { DM_GROUND, { 0 }, 0 };
+    struct bytebuf rb       = { NULL, 0, 0 };
+
+    opt.stat_t_first = 0;
+    opt.stat_t_last  = 0;
+    opt.stat_d_w2r   = 0;
+    opt.stat_d_first = 0;
+    opt.stat_d_inter = 0;
+    opt.stat_d_final = 0;
+    opt.stat_chunks  = 0;
+    opt.raw.len      = 0;
+
+    initTermios(0);
+    opt.stat_t_listen = mono_us();
+    if ( opt.replay ) {
+        if (   ( opt.rec_at < opt.nrec )
+            && ( 'L' == opt.rec[opt.rec_at].kind ) )
+        {
+            opt.stat_t_listen = opt.stat_t_write
+                              + ( opt.rec[opt.rec_at].t - opt.rec_q_t );
+            opt.rec_at++;
+        }
+    } else {
+        rec_line( 'L', opt.stat_t_listen, NULL, 0 );
+    }
+    deadline = opt.stat_t_listen + ( opt.delay * 1000 );
+    if ( opt.q_end && ( opt.q_end < deadline ) ) {
+        deadline = opt.q_end;
+    }
+    while ( ! done ) {
+        size_t got = 0;
+        if ( carry_len ) {
+            /* Left over from the last reply, stamped when it came */
+            memcpy( chunk, carry, carry_len );
+            got = carry_len;
+            carry_len = 0;
+            now = carry_t;
+        } else if ( opt.replay ) {
+            got = replay_chunk( chunk, sizeof(chunk), deadline, &now );
+            if ( 0 == got ) {
+                break;
+            }
+        } else {
+            now = mono_us();
+            if ( now >= deadline ) {
+                break;
+            }
+            struct pollfd pfd = { .fd = 0, .events = POLLIN };
+            ret = cnt_poll( &pfd, 1, (int)( ( deadline - now + 999 ) / 1000 ) );
+            if ( 0 > ret ) {
+                if ( EINTR == errno ) {
+                    continue;
+                }
+                break;
+            } else if ( 0 == ret ) {
+                continue;
+            }
+            ret = cnt_read( 0, chunk, sizeof(chunk) );
+            if ( 0 > ret ) {
+                if ( ( EAGAIN == errno ) || ( EINTR == errno ) ) {
+                    continue;
+                }
+                break;
+            } else if ( 0 == ret ) {
+                break;
+            }
+            got = ret;
+            now = mono_us();
+            rec_line( 'R', now, chunk, got );
+        }
+
+        const char *data = chunk;
+        if ( demux ) {
+            rb.len = 0;
+            for ( size_t cx = 0; cx < got; cx++ ) {
+                demux_byte( &dm, chunk[cx], &rb, &opt.typeahead );
+            }
+            if ( 0 == rb.len ) {
+                /* Only keys, or half a sequence, keep waiting */
+                continue;
+            }
+            data = rb.b;
+            got  = rb.len;
+        }
+
+        if ( opt.stat_chunks < STAT_CHUNKS ) {
+            opt.stat_chunk_t[opt.stat_chunks]   = now;
+            opt.stat_chunk_len[opt.stat_chunks] = got;
+        }
+        if ( 0 == opt.stat_chunks ) {
+            opt.stat_t_first = now;
+            opt.stat_d_first = now - opt.stat_t_listen;
+            opt.stat_d_w2r   = now - opt.stat_t_write;
+        } else if ( now - opt.stat_t_last > opt.stat_d_inter ) {
+            opt.stat_d_inter = now - opt.stat_t_last;
+        }
+        opt.stat_chunks++;
+        opt.stat_t_last  = now;
+        opt.stat_d_final = now - opt.stat_t_write;
+        /* A carried chunk came before listening, wait from then on */
+        deadline = ( ( now > opt.stat_t_listen ) ? now : opt.stat_t_listen )
+                 + wait_for_more;
+        if ( opt.budget_end && ( opt.budget_end < deadline ) ) {
+            deadline = opt.budget_end;
+        }
+
+        size_t used = reply_take( data, got, &opt.raw, REPLY_MAX, &done );
+        if ( ( 1 == done ) && ( got - used <= CARRY_MAX ) ) {
+            carry_len = got - used;
+            carry_t   = now;
+            memcpy( carry, &data[used], carry_len );
+        } else if ( 2 == done ) {
+            fprintf( stderr, "# Reply to %s cut at %d bytes, the rest "
+                    "dropped\n", opt.qname ? opt.qname : "query", REPLY_MAX );
+        }
+    }
+    demux_flush( &dm, &opt.typeahead );
+    free( rb.b );
+    resetTermios();
+    return ( opt.raw.len );
+}
+
+/***************************************
+ * The next whole reply to a batch just sent with term_send(), into
+ * r->rep.  Returns 1 with one, or 0 once opt.delay has passed with
+ * nothing more (no later than --budget allows).  Set r->deadline to
+ * opt.stat_t_write + opt.delay first; keys typed meanwhile are put in
+ * opt.typeahead, and the caller ends with demux_flush() on r->dm.
+ */
+int
+replies_next( struct replies_s *r )
+{
+    r->rep.len = 0;
+    for ( ;; ) {
+        while ( r->at < r->len ) {
+            demux_byte( &r->dm, r->chunk[r->at++], &r->rep, &opt.typeahead );
+            if ( r->rep.len && ( DM_GROUND == r->dm.state ) ) {
+                return 1;
+            }
+        }
+        if ( opt.budget_end && ( opt.budget_end < r->deadline ) ) {
+            r->deadline = opt.budget_end;
+        }
+        r->len = 0;
+        r->at  = 0;
+        if ( opt.replay ) {
+            r->len = replay_chunk( r->chunk, sizeof(r->chunk), r->deadline,
+                                   &r->now );
+        } else {
+            r->now = mono_us();
+            struct pollfd pfd = { .fd = 0, .events = POLLIN };
+            if (   ( r->now < r->deadline )
+                && ( 0 < cnt_poll( &pfd, 1,
+                               (int)( ( r->deadline - r->now + 999 ) / 1000 ) ) ) )
+            {
+                ssize_t ret = cnt_read( 0, r->chunk, sizeof(r->chunk) );
+                if ( ( 0 > ret ) && ( ( EINTR == errno ) || ( EAGAIN == errno ) ) ) {
+                    continue;
+                }
+                r->len = ( 0 < ret ) ? ret : 0;
+                r->now = mono_us();
+                rec_line( 'R', r->now, r->chunk, r->len );
+            }
+        }
+        if ( 0 == r->len ) {
+            return 0;
+        }
+        r->deadline = r->now + ( opt.delay * 1000 );
+    }
+}
+
+int
+cmp_ll( const void *a, const void *b )
+{
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return ( x > y ) - ( x < y );
+}
+
+/* Nearest-rank percentile of an already sorted list */
+long long
+pctile( long long *v, size_t n, int pct )
+{
+    size_t rank = ( ( n * pct ) + 99 ) / 100;
+    if ( 0 == rank ) {
+        rank = 1;
+    }
+    return v[rank - 1];
+}
+
+/***************************************
+ * Append this query to --stats-log, then read the whole log back
+ * and summarize every answered run of the same query.
+ * Log line: qname w2r first final inter length (microseconds)
+ */
+void
+stats_history( long int got )
+{
+    FILE *fh = fopen( opt.stats_log, "a+" );
+    if ( NULL == fh ) {
+        fprintf( stderr, "Unable to open '%s': %s\n",
+            opt.stats_log, strerror(errno) );
+        return;
+    }
+    fprintf( fh, "%s %lld %lld %lld %lld %ld\n", opt.qname,
+            opt.stat_d_w2r, opt.stat_d_first, opt.stat_d_final,
+            opt.stat_d_inter, got );
+    fflush( fh );
+    rewind( fh );
+
+    size_t     n = 0, max = 0;
+    long long *col[4] = { NULL, NULL, NULL, NULL };
+    char       name[64];
+    long long  v[4];
+    long int   len;
+    while ( 6 == fscanf( fh, "%63s %lld %lld %lld %lld %ld",
+                name, &v[0], &v[1], &v[2], &v[3], &len ) ) {
+        if ( ( 0 == len ) || ( 0 != strcmp( name, opt.qname ) ) ) {
+            continue;
+        }
+        if ( n == max ) {
+            max = max ? ( max * 2 ) : 64;
+            for ( int cx = 0; cx < 4; cx++ ) {
+                col[cx] = realloc( col[cx], max * sizeof(long long) );
+                if ( NULL == col[cx] ) {
+                    fprintf(stderr, "%s\n", strerror(errno) );
+                    exit ( 1 );
+                }
+            }
+        }
+        for ( int cx = 0; cx < 4; cx++ ) {
+            col[cx][n] = v[cx];
+        }
+        n++;
+    }
+    fclose( fh );
+
+    if ( n ) {
+        const char *label[4] = { "write_to_read", "first_byte",
+                                 "complete", "max_gap" };
+        OUTPUT("# history : %s, %zu answered runs, p50/p90/p99 us\n",
+                opt.qname, n );
+        for ( int cx = 0; cx < 4; cx++ ) {
+            qsort( col[cx], n, sizeof(long long), cmp_ll );
+            OUTPUT("#   %-13s : %lld / %lld / %lld\n", label[cx],
+                    pctile( col[cx], n, 50 ),
+                    pctile( col[cx], n, 90 ),
+                    pctile( col[cx], n, 99 ) );
+        }
+    }
+    for ( int cx = 0; cx < 4; cx++ ) {
+        free( col[cx] );
+    }
+}
+
+/***************************************
+ * --stats=full: the counters since the last call (the whole run for
+ * "session"), as one line.
+ */
+void
+counts_action( const char *label )
+{
+    struct counts_s *c = &opt.cnt;
+    struct counts_s  z = { 0 };
+    struct counts_s *m = strcmp( label, "session" ) ? &opt.cnt_mark : &z;
+
+    if ( ! opt.stats_full ) {
+        return;
+    }
+    OUTPUT("# counts %s : read %ld, write %ld, poll %ld, empty %ld, "
+            "in %ld, out %ld, tcsetattr %ld, cache %ld\n", label,
+            c->read - m->read, c->write - m->write, c->poll - m->poll,
+            c->empty - m->empty, c->in - m->in, c->out - m->out,
+            c->tcset - m->tcset, c->cache - m->cache );
+    opt.cnt_mark = opt.cnt;
+}
+
+void
+stats_print( long int got )
+{
+    OUTPUT("#### STATS \n" );
+    OUTPUT("# length : %ld", got );
+    if ( got ) {
+        OUTPUT(", chunks : %d", opt.stat_chunks );
+        OUTPUT(", write_to_read : %lld us", opt.stat_d_w2r );
+        OUTPUT(", first_byte : %lld us", opt.stat_d_first );
+        OUTPUT(", complete : %lld us", opt.stat_d_final );
+    }
+    if ( opt.stat_d_inter ) {
+        OUTPUT(", max_gap : %lld us", opt.stat_d_inter );
+    }
+    OUTPUT("\n" );
+    if ( opt.debug ) {
+        for ( int cx = 0; ( cx < opt.stat_chunks ) && ( cx < STAT_CHUNKS );
+                cx++ )
+        {
+            OUTPUT("# chunk %d : +%lld us, %zu bytes\n", cx,
+                    opt.stat_chunk_t[cx] - opt.stat_t_write,
+                    opt.stat_chunk_len[cx] );
+        }
+        OUTPUT("# tty : %s\n", opt.term );
+    }
+    counts_action( opt.qname );
+    if ( opt.stats_log ) {
+        stats_history( got );
+    }
+}
+
+/***************************************
+ * --ping N: time N DA1 (or DSR 5) round trips, one at a time or, with
+ * --ping-pipeline, all sent in one write.  One at a time, each RTT is
+ * from its write to its reply; pipelined, each is from the write to
+ * that reply, so min is first-reply latency and the rate is the
+ * throughput.  Replies are taken with replies_next(), and --stats
+ * reports the run as one reply per chunk, from the first write.
+ */
+int
+do_ping()
+{
+    static const char da1[] = "\033[c";
+    static const char dsr[] = "\033[5n";
+    const char *q      = opt.ping_dsr ? dsr : da1;
+    size_t      qln    = strlen( q );
+    long long  *rtt    = calloc( opt.ping, sizeof(long long) );
+    struct bytebuf all = { NULL, 0, 0 };
+    struct replies_s r;
+    int        sent    = 0;
+    int        got     = 0;
+    int        lost    = 0;
+    long       bytes   = 0;
+    long long  t0      = 0;
+    long long  start   = 0;       /* first write */
+    long long  last    = 0;       /* last reply */
+
+    if ( NULL == rtt ) {
+        exit( 1 );
+    }
+    memset( &r, 0, sizeof(r) );
+    /* A DSR 5 answer is a plain CSI ... n */
+    r.dm.finals = opt.ping_dsr ? "n" : NULL;
+    opt.qname = "ping";
+    opt.qid   = Q_NONE;
+    opt.stat_d_inter = 0;
+    opt.stat_chunks  = 0;
+    if ( NULL == opt.var ) {
+        opt.var = "TERMPING";
+    }
+    initTermios(0);
+    if ( opt.ping_pipe ) {
+        for ( int cx = 0; cx < opt.ping; cx++ ) {
+            bb_put( &all, q, qln );
+        }
+    }
+    while ( got + lost < opt.ping ) {
+        if ( sent == got + lost ) {
+            if (   opt.budget_end
+                && ( opt.budget_end - mono_us()
+                     < ( opt.plan_rtt ? opt.plan_rtt : PLAN_RTT ) ) )
+            {
+                bb_printf( &opt.skipped, "%sping", opt.skipped.len ? " " : "" );
+                break;
+            }
+            if ( opt.ping_pipe ) {
+                term_send( all.b, all.len, 1 );
+                sent = opt.ping;
+            } else {
+                term_send( q, qln, 1 );
+                sent++;
+            }
+            t0 = opt.stat_t_write;
+            opt.stat_t_listen = t0;
+            r.deadline = t0 + ( opt.delay * 1000 );
+            if ( 0 == start ) {
+                start = t0;
+            }
+        }
+        if ( ! replies_next( &r ) ) {
+            /* Timed out: pipelined, the rest are lost; else just this */
+            lost = sent - got;
+            continue;
+        }
+        if ( opt.stat_chunks < STAT_CHUNKS ) {
+            opt.stat_chunk_t[opt.stat_chunks]   = r.now;
+            opt.stat_chunk_len[opt.stat_chunks] = r.rep.len;
+        }
+        if ( got && ( r.now - last > opt.stat_d_inter ) ) {
+            opt.stat_d_inter = r.now - last;
+        }
+        opt.stat_chunks++;
+        bytes += r.rep.len;
+        rtt[got] = r.now - t0;
+        if ( rtt[got] > opt.plan_rtt ) {
+            opt.plan_rtt = rtt[got];
+        }
+        got++;
+        last = r.now;
+    }
+    demux_flush( &r.dm, &opt.typeahead );
+    resetTermios();
+    term_cleanline();
+
+    OUTPUT("#### PING %s x %d, %s\n", opt.ping_dsr ? "dsr" : "da1", opt.ping,
+            opt.ping_pipe ? "pipelined" : "one at a time" );
+    OUTPUT("# replies : %d, lost : %d\n", got, lost );
+    if ( opt.wantstat ) {
+        /* The whole run, as if one query from the first write */
+        opt.stat_t_write = start;
+        opt.stat_d_w2r   = got ? opt.stat_chunk_t[0] - start : 0;
+        opt.stat_d_first = opt.stat_d_w2r;
+        opt.stat_d_final = got ? last - start : 0;
+        stats_print( bytes );
+    }
+    if ( got ) {
+        /* One at a time, the time spent waiting (replays the same) */
+        long long span = last - start;
+        long long rate = 0;
+        if ( ! opt.ping_pipe ) {
+            span = 0;
+            for ( int cx = 0; cx < got; cx++ ) {
+                span += rtt[cx];
+            }
+        }
+        if ( span > 0 ) {
+            rate = ( got * 1000000LL ) / span;
+        }
+        qsort( rtt, got, sizeof(long long), cmp_ll );
+        OUTPUT("# rtt : min %lld us, median %lld us, p99 %lld us, "
+                "max %lld us\n", rtt[0], pctile( rtt, got, 50 ),
+                pctile( rtt, got, 99 ), rtt[got - 1] );
+        OUTPUT("# rate : %lld replies/s\n", rate );
+        OUTPUT("%s='%lld %lld %lld %lld %lld'; export %s; \n", opt.var,
+                rtt[0], pctile( rtt, got, 50 ), pctile( rtt, got, 99 ),
+                rtt[got - 1], rate, opt.var );
+    }
+    if ( opt.skipped.len ) {
+        OUTPUT( "TERMREAD_SKIPPED='%s'; export TERMREAD_SKIPPED; \n",
+                opt.skipped.b );
+    }
+    typeahead_handoff( STDIN_FILENO, &opt.typeahead, &opt.outbuf );
+    term_close();
+    free( r.rep.b );
+    free( all.b );
+    free( rtt );
+    return ( got ? 0 : 1 );
+}
+
+uint32_t
+le32( const unsigned char *p )
+{
+    return   (uint32_t)p[0]
+          | ( (uint32_t)p[1] << 8 )
+          | ( (uint32_t)p[2] << 16 )
+          | ( (uint32_t)p[3] << 24 );
+}
+
+uint32_t
+fnv1a( const char *b, size_t len )
+{
+    uint32_t h = 0x811c9dc5;
+    for ( size_t cx = 0; cx < len; cx++ ) {
+        h = ( h ^ (unsigned char)b[cx] ) * 0x01000193;
+    }
+    return h;
+}
+
+struct fpdb_s fpdb;
+
+const char *
+fpdb_str( uint32_t off )
+{
+    if ( off >= fpdb.len_strings ) {
+        return "";
+    }
+    return fpdb.strings + off;
+}
+
+int
+fpdb_map( const char *path )
+{
+    int fd = open( path, O_RDONLY );
+    if ( 0 > fd ) {
+        DEBUGOUT("fpdb '%s': %s\n", path, strerror(errno) );
+        return 0;
+    }
+    struct stat st;
+    if ( ( 0 != fstat( fd, &st ) ) || ( FPDB_HEAD > st.st_size ) ) {
+        close( fd );
+        return 0;
+    }
+    void *map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    close( fd );
+    if ( MAP_FAILED == map ) {
+        DEBUGOUT("fpdb '%s': %s\n", path, strerror(errno) );
+        return 0;
+    }
+    const unsigned char *m = map;
+    size_t size = st.st_size;
+    uint32_t nbuckets = le32( m + 16 );
+    uint32_t off_b = le32( m + 28 );
+    uint32_t off_m = le32( m + 32 );
+    uint32_t off_p = le32( m + 36 );
+    uint32_t off_s = le32( m + 40 );
+    uint32_t len_s = le32( m + 44 );
+    if (   ( 0 != memcmp( m, FPDB_MAGIC, 8 ) )
+        || ( FPDB_FORMAT != le32( m + 8 ) )
+        || ( 0 == nbuckets )
+        || ( nbuckets & ( nbuckets - 1 ) )
+        || ( off_b + ( (size_t)nbuckets * 8 ) > size )
+        || ( off_m + ( (size_t)le32( m + 20 ) * 12 ) > size )
+        || ( off_p + ( (size_t)le32( m + 24 ) * 20 ) > size )
+        || ( (size_t)off_s + len_s > size )
+        || ( 0 == len_s )
+        || ( 0 != m[ off_s + len_s - 1 ] ) )
+    {
+        fprintf( stderr, "Not a usable fingerprint database: '%s'\n", path );
+        munmap( map, size );
+        return 0;
+    }
+    fpdb.map         = m;
+    fpdb.size        = size;
+    fpdb.serial      = le32( m + 12 );
+    fpdb.nbuckets    = nbuckets;
+    fpdb.nmatch      = le32( m + 20 );
+    fpdb.nprofile    = le32( m + 24 );
+    fpdb.buckets     = m + off_b;
+    fpdb.matches     = m + off_m;
+    fpdb.profiles    = m + off_p;
+    fpdb.strings     = (const char *)m + off_s;
+    fpdb.len_strings = len_s;
+    DEBUGOUT("fpdb '%s' serial %u, %u keys\n", path, fpdb.serial,
+            fpdb.nmatch );
+    return 1;
+}
+
+/***************************************
+ * Find and map the fingerprint database, first found wins:
+ *   --db, $TERMREAD_DB, next to argv[0], $XDG_DATA_HOME/termread/
+ *   (or ~/.local/share/termread/), then FPDB_PATH.
+ */
+int
+fpdb_open()
+{
+    char  path[PATH_MAX];
+    char *env;
+
+    if ( fpdb.map ) {
+        return 1;
+    }
+    if ( opt.fpdb_path ) {
+        return fpdb_map( opt.fpdb_path );
+    }
+    if ( ( env = getenv("TERMREAD_DB") ) && ( env[0] ) ) {
+        return fpdb_map( env );
+    }
+    char *slash = rindex( opt.argv0, '/' );
+    if ( slash ) {
+        snprintf( path, sizeof(path), "%.*s/termread.fpdb",
+                (int)( slash - opt.argv0 ), opt.argv0 );
+        if ( fpdb_map( path ) ) {
+            return 1;
+        }
+    }
+    if ( ( env = getenv("XDG_DATA_HOME") ) && ( env[0] ) ) {
+        snprintf( path, sizeof(path), "%s/termread/termread.fpdb", env );
+        if ( fpdb_map( path ) ) {
+            return 1;
+        }
+    }
+    else if ( ( env = getenv("HOME") ) && ( env[0] ) ) {
+        snprintf( path, sizeof(path),
+                "%s/.local/share/termread/termread.fpdb", env );
+        if ( fpdb_map( path ) ) {
+            return 1;
+        }
+    }
+    return fpdb_map( FPDB_PATH );
+}
+
+/* Profile index for an exact match key, or -1 */
+int
+fpdb_find( const char *key, size_t len )
+{
+    uint32_t h = fnv1a( key, len );
+    uint32_t mask = fpdb.nbuckets - 1;
+    for ( uint32_t b = h & mask, n = 0; n < fpdb.nbuckets;
+            b = ( b + 1 ) & mask, n++ )
+    {
+        const unsigned char *bk = fpdb.buckets + ( (size_t)b * 8 );
+        uint32_t ix = le32( bk + 4 );
+        if ( 0 == ix ) {
+            break;
+        }
+        if ( ( h != le32( bk ) ) || ( ix > fpdb.nmatch ) ) {
+            continue;
+        }
+        const unsigned char *m = fpdb.matches + ( (size_t)( ix - 1 ) * 12 );
+        uint32_t koff = le32( m );
+        uint32_t klen = le32( m + 4 );
+        if (   ( klen == len )
+            && ( (size_t)koff + klen < fpdb.len_strings )
+            && ( 0 == memcmp( fpdb.strings + koff, key, len ) ) )
+        {
+            uint32_t pix = le32( m + 8 );
+            return ( pix < fpdb.nprofile ) ? (int)pix : -1;
+        }
+    }
+    return -1;
+}
+
+void
+fpdb_profile( int ix, struct fprofile_s *fp )
+{
+    const unsigned char *p = fpdb.profiles + ( (size_t)ix * 20 );
+    fp->name      = fpdb_str( le32( p ) );
+    fp->terms     = fpdb_str( le32( p + 4 ) );
+    fp->flags     = fpdb_str( le32( p + 8 ) );
+    fp->colors    = le32( p + 12 );
+    fp->emoji     = p[16];
+    fp->truecolor = p[17];
+    fp->mode      = p[18];
+    fp->bits      = p[19];
+}
+
+/***************************************
+ * Pull the numeric parameters out of a raw CSI reply like
+ * "\033[?64;1;2c", where `lead` is the '?' or '>' after CSI.
+ * Empty parameters count as 0.  Returns the count, -1 if not a match.
+ */
+int
+csi_params( const char *b, size_t len, char lead, char final,
+            int *p, int max )
+{
+    size_t cx = 3;
+    int    n  = 0;
+    if (   ( 4 > len ) || ( 033 != b[0] ) || ( '[' != b[1] )
+        || ( lead != b[2] ) || ( final != b[len - 1] ) )
+    {
+        return -1;
+    }
+    while ( ( cx < len - 1 ) && ( n < max ) ) {
+        int v = 0;
+        while ( ( cx < len - 1 ) && isdigit( (unsigned char)b[cx] ) ) {
+            v = ( v * 10 ) + ( b[cx++] - '0' );
+        }
+        p[n++] = v;
+        if ( ( cx < len - 1 ) && ( ';' != b[cx++] ) ) {
+            return -1;
+        }
+    }
+    return n;
+}
+
+/* Append one "<n>=<raw>" or "<n>~<class>" key field */
+void
+fp_key_field( struct bytebuf *bb, char field, char op,
+              const char *b, size_t len )
+{
+    char head[3] = { field, op, 0 };
+    if ( bb->len ) {
+        bb_putc( bb, 037 );
+    }
+    bb_put( bb, head, 2 );
+    bb_put( bb, b, len );
+}
+
+/***************************************
+ * The class forms of a DA1 or DA2 reply, most specific first:
+ * Ps;4;22, Ps;4, Ps;22, Ps for DA1 and Pp;Pv, Pp for DA2 (only the
+ * forms the reply actually has).  Returns how many were written.
+ */
+int
+fp_classes( enum query_e q, char cls[4][32] )
+{
+    struct bytebuf *r = &opt.reply[q];
+    int p[32];
+    int n;
+    int ncls = 0;
+
+    if ( Q_DA1 == q ) {
+        n = csi_params( r->b, r->len, '?', 'c', p, 32 );
+        if ( 0 < n ) {
+            int has4 = 0, has22 = 0;
+            for ( int cx = 1; cx < n; cx++ ) {
+                has4  |= ( 4 == p[cx] );
+                has22 |= ( 22 == p[cx] );
+            }
+            if ( has4 && has22 ) {
+                snprintf( cls[ncls++], 32, "%d;4;22", p[0] );
+            }
+            if ( has4 ) {
+                snprintf( cls[ncls++], 32, "%d;4", p[0] );
+            }
+            if ( has22 ) {
+                snprintf( cls[ncls++], 32, "%d;22", p[0] );
+            }
+            snprintf( cls[ncls++], 32, "%d", p[0] );
+        }
+    }
+    else if ( Q_DA2 == q ) {
+        n = csi_params( r->b, r->len, '>', 'c', p, 32 );
+        if ( 1 < n ) {
+            snprintf( cls[ncls++], 32, "%d;%d", p[0], p[1] );
+        }
+        if ( 0 < n ) {
+            snprintf( cls[ncls++], 32, "%d", p[0] );
+        }
+    }
+    return ncls;
+}
+
+/***************************************
+ * Resolve the replies collected so far to a profile.  Tries a fixed
+ * list of keys, most specific first (see fingerprints.dat), so this
+ * is a constant number of hash probes.  Returns profile index or -1.
+ */
+int
+fp_lookup( struct fprofile_s *fp )
+{
+    struct bytebuf key = { NULL, 0, 0 };
+    struct bytebuf *r = opt.reply;
+    char   da1c[5][32];
+    int    nda1c;
+    char   da2c[4][32];
+    int    nda2c;
+    int    found = -1;
+
+    if ( ! fpdb_open() ) {
+        return -1;
+    }
+
+    /* da1 forms: exact, then Ps[;4][;22] classes, most specific first */
+    da1c[0][0] = 0;
+    nda1c = 1 + fp_classes( Q_DA1, da1c + 1 );
+    nda2c = fp_classes( Q_DA2, da2c );
+
+    if ( opt.asked[Q_ENQ] && r[Q_ENQ].len ) {
+        key.len = 0;
+        fp_key_field( &key, 'E', '=', r[Q_ENQ].b, r[Q_ENQ].len );
+        found = fpdb_find( key.b, key.len );
+    }
+    for ( int cx = 0; ( 0 > found ) && ( cx < nda1c ); cx++ ) {
+        for ( int step = 0; ( 0 > found ) && ( step < 5 ); step++ ) {
+            key.len = 0;
+            if ( 0 == cx ) {
+                if ( ! opt.asked[Q_DA1] ) {
+                    break;
+                }
+                fp_key_field( &key, '1', '=', r[Q_DA1].b, r[Q_DA1].len );
+            } else {
+                fp_key_field( &key, '1', '~', da1c[cx], strlen(da1c[cx]) );
+            }
+            if ( 0 == step ) {
+                /* da1 + da2 + da3 */
+                if ( ! ( opt.asked[Q_DA2] && opt.asked[Q_DA3] ) ) {
+                    continue;
+                }
+                fp_key_field( &key, '2', '=', r[Q_DA2].b, r[Q_DA2].len );
+                fp_key_field( &key, '3', '=', r[Q_DA3].b, r[Q_DA3].len );
+            }
+            else if ( 1 == step ) {
+                if ( ! opt.asked[Q_DA2] ) {
+                    continue;
+                }
+                fp_key_field( &key, '2', '=', r[Q_DA2].b, r[Q_DA2].len );
+            }
+            else if ( 4 > step ) {
+                /* da2 classes, Pp;Pv then Pp */
+                if ( step - 2 >= nda2c ) {
+                    continue;
+                }
+                fp_key_field( &key, '2', '~', da2c[step - 2],
+                        strlen( da2c[step - 2] ) );
+            }
+            found = fpdb_find( key.b, key.len );
+            if ( 0 <= found ) {
+                DEBUGOUT("fpdb match on key %zu bytes, step %d, da1 form %d\n",
+                        key.len, step, cx );
+            }
+        }
+    }
+    free( key.b );
+    if ( 0 <= found ) {
+        fpdb_profile( found, fp );
+    }
+    return found;
+}
+
+/* log2(n) in 1/1024ths of a bit */
+long
+lg2_fx( unsigned long n )
+{
+    long ip = 0;
+    long frac = 0;
+    unsigned long long y;
+
+    if ( 2 > n ) {
+        return 0;
+    }
+    while ( 1 < ( n >> ip ) ) {
+        ip++;
+    }
+    /* n / 2^ip, in [1,2) as 16.16 fixed point; square for each bit */
+    y = ( (unsigned long long)n << 16 ) >> ip;
+    for ( long bit = 512; bit; bit >>= 1 ) {
+        y = ( y * y ) >> 16;
+        if ( y >= ( 2 << 16 ) ) {
+            y >>= 1;
+            frac |= bit;
+        }
+    }
+    return ( ip * 1024 ) + frac;
+}
+
+/***************************************
+ * Split match key `ix` into its fields and work out where fp_lookup()
+ * would try it: .rank 0 is ENQ alone, then 1 + (da1 form * 5) + step.
+ * .rank is -1 for a key fp_lookup() never builds.
+ */
+void
+fpdb_key( uint32_t ix, struct fpkey_s *k )
+{
+    const unsigned char *m = fpdb.matches + ( (size_t)ix * 12 );
+    uint32_t koff = le32( m );
+    uint32_t klen = le32( m + 4 );
+    const char *key;
+    const char *end;
+    int form = 0;
+    int step = 4;
+
+    memset( k, 0, sizeof(*k) );
+    k->profile = le32( m + 8 );
+    k->rank    = -1;
+    if (   ( (size_t)koff + klen >= fpdb.len_strings )
+        || ( (uint32_t)k->profile >= fpdb.nprofile ) )
+    {
+        return;
+    }
+    key = fpdb.strings + koff;
+    end = key + klen;
+    while ( key + 2 <= end ) {
+        const char  *f = memchr( key, 037, end - key );
+        enum query_e q = Q_NONE;
+        if ( NULL == f ) {
+            f = end;
+        }
+        switch ( key[0] ) {
+            case '1': q = Q_DA1; break;
+            case '2': q = Q_DA2; break;
+            case '3': q = Q_DA3; break;
+            case 'E': q = Q_ENQ; break;
+        }
+        if ( q ) {
+            k->op[q]  = key[1];
+            k->val[q] = key + 2;
+            k->len[q] = f - key - 2;
+        }
+        key = f + 1;
+    }
+
+    if ( 0 == k->op[Q_DA1] ) {
+        if ( k->op[Q_ENQ] && ! k->op[Q_DA2] && ! k->op[Q_DA3] ) {
+            k->rank = 0;
+        }
+        return;
+    }
+    if ( k->op[Q_ENQ] ) {
+        return;
+    }
+    if ( '~' == k->op[Q_DA1] ) {
+        const char *semi = memchr( k->val[Q_DA1], ';', k->len[Q_DA1] );
+        size_t rest = semi ? (size_t)( k->val[Q_DA1] + k->len[Q_DA1] - semi )
+                           : 0;
+        form = 4;
+        if ( ( 5 == rest ) && ( 0 == memcmp( semi, ";4;22", 5 ) ) ) {
+            form = 1;
+        } else if ( ( 2 == rest ) && ( 0 == memcmp( semi, ";4", 2 ) ) ) {
+            form = 2;
+        } else if ( ( 3 == rest ) && ( 0 == memcmp( semi, ";22", 3 ) ) ) {
+            form = 3;
+        }
+    }
+    if ( ( '=' == k->op[Q_DA2] ) && ( '=' == k->op[Q_DA3] ) ) {
+        step = 0;
+    } else if ( k->op[Q_DA3] ) {
+        return;
+    } else if ( '=' == k->op[Q_DA2] ) {
+        step = 1;
+    } else if ( '~' == k->op[Q_DA2] ) {
+        step = memchr( k->val[Q_DA2], ';', k->len[Q_DA2] ) ? 2 : 3;
+    }
+    k->rank = 1 + ( form * 5 ) + step;
+}
+
+/* Does the reply already collected for q agree with key k */
+int
+fp_field_ok( const struct fpkey_s *k, enum query_e q,
+             char cls[4][32], int ncls )
+{
+    if ( '=' == k->op[q] ) {
+        return ( k->len[q] == opt.reply[q].len )
+            && ( ( 0 == k->len[q] )
+                || ( 0 == memcmp( k->val[q], opt.reply[q].b, k->len[q] ) ) );
+    }
+    if ( '~' == k->op[q] ) {
+        for ( int cx = 0; cx < ncls; cx++ ) {
+            if (   ( strlen( cls[cx] ) == k->len[q] )
+                && ( 0 == memcmp( cls[cx], k->val[q], k->len[q] ) ) )
+            {
+                return 1;
+            }
+        }
+        return 0;
+    }
+    return 1;
+}
+
+/* Do keys a and b expect the same reply to q */
+int
+fp_same( const struct fpkey_s *a, const struct fpkey_s *b, enum query_e q )
+{
+    return ( a->op[q] == b->op[q] )
+        && ( a->len[q] == b->len[q] )
+        && ( ( 0 == a->len[q] )
+            || ( 0 == memcmp( a->val[q], b->val[q], a->len[q] ) ) );
+}
+
+/***************************************
+ * Distinct profiles among keys `c` left after query q is answered the
+ * way key g expects (g NULL: a reply no key expects).  Keys with no
+ * opinion on q survive any reply when `any` is set.  q == Q_NONE
+ * counts them all.
+ */
+int
+plan_nprof( struct fpkey_s **c, int n, enum query_e q,
+            const struct fpkey_s *g, int any, unsigned char *mark )
+{
+    int np = 0;
+
+    memset( mark, 0, fpdb.nprofile );
+    for ( int cx = 0; cx < n; cx++ ) {
+        if ( c[cx]->op[q] ) {
+            if ( ( NULL == g ) || ( ! fp_same( c[cx], g, q ) ) ) {
+                continue;
+            }
+        }
+        else if ( ! any ) {
+            continue;
+        }
+        if ( ! mark[c[cx]->profile] ) {
+            mark[c[cx]->profile] = 1;
+            np++;
+        }
+    }
+    return np;
+}
+
+/***************************************
+ * Expected information from asking q, in 1/1024 bits: profiles in
+ * the running now, less the expected log2 of profiles left after the
+ * reply, each possible reply weighted by the profiles expecting it.
+ * *answer gets the chance (per 1000) that q is answered at all.
+ */
+long
+plan_gain( struct fpkey_s **c, int n, enum query_e q,
+           unsigned char *mark, long *answer )
+{
+    int  all  = plan_nprof( c, n, Q_NONE, NULL, 1, mark );
+    int  wu   = plan_nprof( c, n, q, NULL, 1, mark );
+    long w    = wu;
+    long rem  = wu * lg2_fx( wu );
+    long ans2 = wu;         /* no opinion counts as a coin flip */
+
+    for ( int cx = 0; cx < n; cx++ ) {
+        int first = 1;
+        if ( 0 == c[cx]->op[q] ) {
+            continue;
+        }
+        for ( int jx = 0; first && ( jx < cx ); jx++ ) {
+            first = ! ( c[jx]->op[q] && fp_same( c[jx], c[cx], q ) );
+        }
+        if ( ! first ) {
+            continue;
+        }
+        int wg = plan_nprof( c, n, q, c[cx], 0, mark );
+        w   += wg;
+        rem += wg * lg2_fx( plan_nprof( c, n, q, c[cx], 1, mark ) );
+        if ( c[cx]->len[q] ) {
+            ans2 += 2 * wg;
+        }
+    }
+    if ( 0 == w ) {
+        *answer = 0;
+        return 0;
+    }
+    *answer = ( ans2 * 1000 ) / ( 2 * w );
+    return lg2_fx( all ) - ( rem / w );
+}
+
+/***************************************
+ * Probe planner for --identify.  Of the queries not asked yet, pick
+ * the one with the most expected information per expected
+ * microsecond (an unanswered query costs the whole --delay), or
+ * Q_NONE once no reply could change what fp_lookup() will find.
+ *
+ * A key stays in the running while every reply so far agrees with
+ * it.  The answer is settled when the best ranked key with all of its
+ * fields asked can only be beaten by undecided keys for the same
+ * profile.  ENQ answerback is user configurable and few terminals
+ * send one, so ENQ only keys are a last resort tie breaker, never a
+ * reason on their own to keep asking.
+ */
+enum query_e
+plan_next()
+{
+    static const enum query_e ask[3] = { Q_DA1, Q_DA2, Q_DA3 };
+    static const char *qname[Q_MAX] = {
+        [Q_NONE] = "none", [Q_ENQ] = "enq", [Q_DA1] = "term",
+        [Q_DA2] = "term2", [Q_DA3] = "term3"
+    };
+    struct fpkey_s  *keys;
+    struct fpkey_s **c;
+    unsigned char   *mark;
+    char   cls[Q_MAX][4][32];
+    int    ncls[Q_MAX] = { 0 };
+    int    nc = 0;
+    int    n = 0;
+    int    nprof;
+    int    have_enq = 0;
+    struct fpkey_s *best = NULL;
+    enum query_e next = Q_NONE;
+
+    opt.plan_settled = 0;
+    if ( ! fpdb_open() ) {
+        return Q_NONE;
+    }
+    if ( pcache_load() ) {
+        opt.plan_settled = 1;
+        return Q_NONE;
+    }
+    keys = calloc( fpdb.nmatch + 1, sizeof(*keys) );
+    c    = calloc( fpdb.nmatch + 1, sizeof(*c) );
+    mark = calloc( fpdb.nprofile + 1, 1 );
+    if ( ( NULL == keys ) || ( NULL == c ) || ( NULL == mark ) ) {
+        exit( 1 );
+    }
+    for ( enum query_e q = Q_DA1; q <= Q_DA2; q++ ) {
+        if ( opt.asked[q] ) {
+            ncls[q] = fp_classes( q, cls[q] );
+        }
+    }
+
+    for ( uint32_t ix = 0; ix < fpdb.nmatch; ix++ ) {
+        struct fpkey_s *k = &keys[ix];
+        int ok = 1;
+        fpdb_key( ix, k );
+        if ( 0 > k->rank ) {
+            continue;
+        }
+        if ( ( 0 == k->rank ) && ( ! opt.asked[Q_ENQ] ) ) {
+            have_enq = 1;
+            continue;
+        }
+        k->settled = 1;
+        for ( enum query_e q = Q_ENQ; ok && ( q <= Q_DA3 ); q++ ) {
+            if ( 0 == k->op[q] ) {
+                continue;
+            }
+            if ( ! opt.asked[q] ) {
+                k->settled = 0;
+            } else {
+                ok = fp_field_ok( k, q, cls[q], ncls[q] );
+            }
+        }
+        if ( ! ok ) {
+            continue;
+        }
+        if ( k->settled && ( ( NULL == best ) || ( k->rank < best->rank ) ) ) {
+            best = k;
+        }
+        c[nc++] = k;
+    }
+    /* Only the best settled key, and undecided keys that outrank it */
+    for ( int cx = 0; cx < nc; cx++ ) {
+        if (   ( c[cx] == best )
+            || ( ( ! c[cx]->settled )
+                && ( ( NULL == best ) || ( c[cx]->rank < best->rank ) ) ) )
+        {
+            c[n++] = c[cx];
+        }
+    }
+    nprof = plan_nprof( c, n, Q_NONE, NULL, 1, mark );
+
+    if ( best && ( 1 == nprof ) ) {
+        struct fprofile_s fp;
+        fpdb_profile( best->profile, &fp );
+        opt.plan_settled = 1;
+        DEBUGOUT("plan: settled on '%s'\n", fp.name );
+    }
+    else if ( 0 < n ) {
+        long long rtt  = opt.plan_rtt ? opt.plan_rtt : PLAN_RTT;
+        long long wait = opt.delay * 1000;
+        long long top  = 0;
+        for ( int ax = 0; ax < 3; ax++ ) {
+            enum query_e q = ask[ax];
+            long ans;
+            if ( opt.asked[q] ) {
+                continue;
+            }
+            if ( ( Q_DA1 == q ) ? ( is_vtxx( opt.envterm )
+                                    && is_vtxxx( opt.envterm ) )
+                                : ( 0 != is_vtxxx( opt.envterm ) ) )
+            {
+                continue;   /* term_write() would refuse it */
+            }
+            long gain = plan_gain( c, n, q, mark, &ans );
+            long long cost = ( ( ans * rtt ) + ( ( 1000 - ans ) * wait ) )
+                             / 1000;
+            long long score = ( gain * 1000000LL ) / ( cost ? cost : 1 );
+            DEBUGOUT("plan: %s gain %ld/1024 bits, cost %lld us\n",
+                    qname[q], gain, cost );
+            if ( ( 0 < gain ) && ( score > top ) ) {
+                top  = score;
+                next = q;
+            }
+        }
+        if ( ( Q_NONE == next ) && have_enq ) {
+            next = Q_ENQ;
+        }
+    }
+    DEBUGOUT("plan: %d keys, %d profiles in the running, next %s\n",
+            n, nprof, qname[next] );
+    free( keys );
+    free( c );
+    free( mark );
+    return next;
+}
+
+/***************************************
+ * TERM candidates for a profile.  With FPDB_COLORSUFFIX each name is
+ * preceded by its color variants, the way ttguess.sh
+ * __set_cterm_fallback searches them.
+ */
+void
+fp_terms( struct fprofile_s *fp, struct bytebuf *bb )
+{
+    const char *suffix[] = {
+        "-256color", "+256color", "-88color", "+88color",
+        "-16color", "+16color", "+color", "-8color", "+color8", "+c",
+        NULL
+    };
+    int from = 10;
+
+    bb->len = 0;
+    bb_put( bb, "", 0 );
+    if ( ! ( fp->bits & FPDB_COLORSUFFIX ) ) {
+        bb_put( bb, fp->terms, strlen( fp->terms ) );
+        return;
+    }
+    if ( 256 <= fp->colors ) {
+        from = 0;
+    } else if ( 88 <= fp->colors ) {
+        from = 2;
+    } else if ( 16 <= fp->colors ) {
+        from = 4;
+    } else if ( 8 <= fp->colors ) {
+        from = 7;
+    } else if ( 0 < fp->colors ) {
+        from = 9;
+    }
+    for ( const char *t = fp->terms; *t; ) {
+        size_t len = strcspn( t, " " );
+        for ( int cx = from; suffix[cx]; cx++ ) {
+            if ( bb->len ) {
+                bb_putc( bb, ' ' );
+            }
+            bb_put( bb, t, len );
+            bb_put( bb, suffix[cx], strlen( suffix[cx] ) );
+        }
+        if ( bb->len ) {
+            bb_putc( bb, ' ' );
+        }
+        bb_put( bb, t, len );
+        t += len;
+        t += strspn( t, " " );
+    }
+}
+
+/***************************************
+ * DA1 feature names by Ps, from docs/PrimaryDeviceAttributes_Master.md.
+ * Ps is also its bit in TERMDA1_BITS, except 314 which is bit 63.
+ */
+const char *da1_name[64] = {
+    [1]  = "132cols",     [2]  = "printer",     [3]  = "regis",
+    [4]  = "sixel",       [5]  = "katakana",    [6]  = "selerase",
+    [7]  = "drcs",        [8]  = "udk",         [9]  = "nrcs",
+    [10] = "kanji",       [11] = "status",      [12] = "serbocroat",
+    [13] = "localedit",   [14] = "8bit",        [15] = "techset",
+    [16] = "locator",     [17] = "tsi",         [18] = "windowing",
+    [19] = "dualsession", [20] = "apl",         [21] = "hscroll",
+    [22] = "color",       [23] = "greek",       [24] = "turkish",
+    [25] = "arabic1",     [26] = "arabic2",     [27] = "arabic3",
+    [28] = "rectedit",    [29] = "textlocator", [30] = "hanzi",
+    [32] = "macros",      [33] = "hangul",      [34] = "icelandic",
+    [35] = "arabicctl",   [36] = "arabicnoctl", [37] = "thai",
+    [38] = "outline",     [39] = "pagemem",     [42] = "latin2",
+    [44] = "pcterm",      [45] = "softkeys",    [46] = "ascii",
+    [52] = "clipboard",   [63] = "capture",
+};
+#define DA1_BIT_314 63
+
+/***************************************
+ * --decode: what a DA1 reply says, as TERMDA1_CLASS (the first Ps,
+ * 61 to 65 for a VT200 or later) and, for those, TERMDA1_BITS (bit Ps
+ * set for each Ps) and TERMDA1_FLAGS (their names, psNN if unknown).
+ * A VT100 class reply carries options, not features, so has neither.
+ */
+void
+da1_decode( const char *b, size_t len, struct bytebuf *out )
+{
+    int      p[64];
+    int      n = csi_params( b, len, '?', 'c', p, 64 );
+    uint64_t bits = 0;
+    size_t   at;
+
+    if ( 1 > n ) {
+        return;
+    }
+    bb_printf( out, "TERMDA1_CLASS=%d; export TERMDA1_CLASS; \n", p[0] );
+    if ( 61 > p[0] ) {
+        return;
+    }
+    bb_printf( out, "TERMDA1_FLAGS='" );
+    at = out->len;
+    for ( int cx = 1; cx < n; cx++ ) {
+        int bit = p[cx];
+        if ( 314 == bit ) {
+            bit = DA1_BIT_314;
+        } else if ( DA1_BIT_314 <= bit ) {
+            bit = 0;
+        }
+        if ( out->len > at ) {
+            bb_putc( out, ' ' );
+        }
+        if ( bit ) {
+            bits |= ( 1ULL << bit );
+        }
+        if ( bit && da1_name[bit] ) {
+            bb_printf( out, "%s", da1_name[bit] );
+        } else {
+            bb_printf( out, "ps%d", p[cx] );
+        }
+    }
+    bb_printf( out, "'; export TERMDA1_FLAGS; \n" );
+    bb_printf( out, "TERMDA1_BITS=0x%llx; export TERMDA1_BITS; \n",
+            (unsigned long long)bits );
+}
+
+/* da2_known_s .ver, how Pv (and Pc) carry the version */
+#define V_NONE   0      /* a constant, no version in it */
+#define V_SEMVER 1      /* Pv = major * 10000 + minor * 100 + patch */
+#define V_PATCH  2      /* Pv is xterm's patch number */
+#define V_KITTY  3      /* Pv = 4000 + major, Pc = minor */
+#define V_DEC    4      /* Pv = firmware * 10 */
+
+/***************************************
+ * Known DA2 replies, first match wins, so the constants emulators
+ * copied from each other come before the general forms.  A -1 Pc is
+ * any.  Pp alone (the DEC model an emulator claims) is da2_model().
+ */
+struct da2_known_s {
+    int         pp;
+    int         pv_min;
+    int         pv_max;
+    int         pc;
+    const char *name;
+    int         ver;
+} da2_known[] = {
+    {  0,    10,     10,  1, "windows-terminal", V_NONE },
+    {  0,   136,    136,  0, "putty",            V_NONE },
+    {  0,   115,    115, -1, "konsole",          V_NONE },
+    {  1,   115,    115, -1, "konsole",          V_NONE },
+    {  0,    95,     95,  0, "iterm2",           V_NONE },
+    { 64,  2500,   2500,  0, "iterm2",           V_NONE },
+    {  1,    95,     95,  0, "terminal.app",     V_NONE },
+    {  1,   277,    277,  0, "wezterm",          V_NONE },
+    {  1,    10,     10,  0, "ghostty",          V_NONE },
+    {  1,  4000,   4099, -1, "kitty",            V_KITTY },
+    {  1,  1000,   9999,  0, "vte",              V_SEMVER },
+    {  1, 10000, 999999,  0, "foot",             V_SEMVER },
+    { 65,  1000,  99999,  1, "vte",              V_SEMVER },
+    {  0,  1000,  99999,  1, "alacritty",        V_SEMVER },
+    { 77,     0, 999999, -1, "mintty",           V_SEMVER },
+    { 83,     0, 999999, -1, "screen",           V_SEMVER },
+    { 84,     0, 999999, -1, "tmux",             V_NONE },
+    { 85,     0, 999999, -1, "rxvt-unicode",     V_NONE },
+    { 82,     0, 999999, -1, "rxvt",             V_NONE },
+    { -1,   100,    999,  0, "xterm",            V_PATCH },
+    { -1,     0,     99,  0, NULL,               V_DEC },
+};
+
+/* The DEC terminal a DA2 Pp stands for, NULL if none */
+const char *
+da2_model( int pp )
+{
+    switch ( pp ) {
+        case 0:  return "vt100";
+        case 1:  return "vt220";
+        case 2:  return "vt240";
+        case 18: return "vt330";
+        case 19: return "vt340";
+        case 24: return "vt320";
+        case 28: return "decterm";
+        case 41: return "vt420";
+        case 61: return "vt510";
+        case 64: return "vt520";
+        case 65: return "vt525";
+        default: return NULL;
+    }
+}
+
+/***************************************
+ * --decode: a DA2 reply (CSI > Pp ; Pv ; Pc c) looked up in da2_known[]
+ * as TERMDA2_TYPE (the emulator, or the DEC model for a real one),
+ * TERMDA2_MODEL (the DEC model Pp claims), and where Pv carries one,
+ * TERMDA2_VERSION and TERMDA2_VERNUM (major * 10000 + minor * 100 +
+ * patch, for [ -ge ] tests).
+ */
+void
+da2_decode( const char *b, size_t len, struct bytebuf *out )
+{
+    int p[3] = { 0, 0, 0 };
+    int n = csi_params( b, len, '>', 'c', p, 3 );
+    const char *model = NULL;
+    const struct da2_known_s *k = NULL;
+    int maj = 0;
+    int min = 0;
+    int pat = 0;
+
+    if ( 1 > n ) {
+        return;
+    }
+    model = da2_model( p[0] );
+    for ( int cx = 0; cx < sizeof(da2_known) / sizeof(da2_known[0]); cx++ ) {
+        const struct da2_known_s *t = &da2_known[cx];
+        if (   ( ( t->pp == p[0] ) || ( ( 0 > t->pp ) && model ) )
+            && ( t->pv_min <= p[1] ) && ( t->pv_max >= p[1] )
+            && ( ( 0 > t->pc ) || ( t->pc == p[2] ) ) )
+        {
+            k = t;
+            break;
+        }
+    }
+    if ( k && ( k->name || model ) ) {
+        bb_printf( out, "TERMDA2_TYPE='%s'; export TERMDA2_TYPE; \n",
+                k->name ? k->name : model );
+    }
+    if ( model ) {
+        bb_printf( out, "TERMDA2_MODEL='%s'; export TERMDA2_MODEL; \n",
+                model );
+    }
+    switch ( k ? k->ver : V_NONE ) {
+        case V_SEMVER:
+            maj = p[1] / 10000;
+            min = ( p[1] / 100 ) % 100;
+            pat = p[1] % 100;
+            break;
+        case V_PATCH:
+            maj = p[1];
+            break;
+        case V_KITTY:
+            maj = p[1] - 4000;
+            min = p[2];
+            break;
+        case V_DEC:
+            maj = p[1] / 10;
+            min = p[1] % 10;
+            break;
+        default:
+            return;
+    }
+    if ( V_PATCH == k->ver ) {
+        bb_printf( out, "TERMDA2_VERSION='%d'; ", maj );
+    } else {
+        bb_printf( out, "TERMDA2_VERSION='%d.%d.%d'; ", maj, min, pat );
+    }
+    bb_printf( out, "export TERMDA2_VERSION; \n" );
+    bb_printf( out, "TERMDA2_VERNUM=%d; export TERMDA2_VERNUM; \n",
+            ( maj * 10000 ) + ( min * 100 ) + pat );
+}
+
+/* --decode the reply to q, when it is one that can be */
+void
+reply_decode( enum query_e q, const char *b, size_t len, struct bytebuf *out )
+{
+    if ( ( NULL == b ) || ( 0 == len ) ) {
+        return;
+    }
+    if ( Q_DA1 == q ) {
+        da1_decode( b, len, out );
+    }
+    else if ( Q_DA2 == q ) {
+        da2_decode( b, len, out );
+    }
+}
+
+/***************************************
+ * --pick-term: the first of the space separated TERMs in list with a
+ * terminfo entry, printed as TERM.  Each directory is searched in the
+ * order ncurses does ($TERMINFO, ~/.terminfo, $TERMINFO_DIRS, then the
+ * usual system ones), opened once and probed with fstatat() for both
+ * the "x/xterm" and (macOS) "78/xterm" layouts.  Returns 0, with
+ * nothing added to term, when none is found.
+ */
+int
+pick_term( const char *list, struct bytebuf *term )
+{
+    const char *sys[] = {
+        "/etc/terminfo", "/lib/terminfo", "/usr/share/terminfo",
+        "/usr/local/share/terminfo", NULL
+    };
+    struct bytebuf dirs = { NULL, 0, 0 };
+    int         fd[32];
+    int         nfd = 0;
+    char       *env;
+    char        name[PATH_MAX];
+    struct stat st;
+
+    if ( ( env = getenv("TERMINFO") ) && ( env[0] ) ) {
+        bb_printf( &dirs, "%s:", env );
+    }
+    if ( ( env = getenv("HOME") ) && ( env[0] ) ) {
+        bb_printf( &dirs, "%s/.terminfo:", env );
+    }
+    if ( ( env = getenv("TERMINFO_DIRS") ) && ( env[0] ) ) {
+        bb_printf( &dirs, "%s:", env );
+    }
+    for ( int cx = 0; sys[cx]; cx++ ) {
+        bb_printf( &dirs, "%s:", sys[cx] );
+    }
+    for ( char *d = dirs.b; *d && ( nfd < 32 ); ) {
+        size_t len = strcspn( d, ":" );
+        if ( len ) {
+            d[len] = 0;
+            fd[nfd] = open( d, O_RDONLY | O_DIRECTORY );
+            if ( 0 <= fd[nfd] ) {
+                nfd++;
+            }
+            d[len] = ':';
+        }
+        d += len;
+        d += strspn( d, ":" );
+    }
+
+    for ( const char *t = list; *t; ) {
+        size_t len = strcspn( t, " " );
+        if ( len && ( len < sizeof(name) - 4 ) && ( '.' != t[0] )
+            && ( NULL == memchr( t, '/', len ) ) )
+        {
+            for ( int cx = 0; cx < nfd; cx++ ) {
+                snprintf( name, sizeof(name), "%c/%.*s", t[0], (int)len, t );
+                int found = ( 0 == fstatat( fd[cx], name, &st, 0 ) );
+                if ( ! found ) {
+                    snprintf( name, sizeof(name), "%02x/%.*s",
+                            (unsigned char)t[0], (int)len, t );
+                    found = ( 0 == fstatat( fd[cx], name, &st, 0 ) );
+                }
+                if ( found && S_ISREG( st.st_mode ) ) {
+                    DEBUGOUT("pick-term: %s in directory %d\n", name, cx );
+                    bb_put( term, t, len );
+                    list = "";
+                    break;
+                }
+            }
+            if ( ! *list ) {
+                break;
+            }
+        }
+        t += len;
+        t += strspn( t, " " );
+    }
+    for ( int cx = 0; cx < nfd; cx++ ) {
+        close( fd[cx] );
+    }
+    free( dirs.b );
+    return ( 0 == *list );
+}
+
+/***************************************
+ * --init: everything a shell rc wants from --identify on one line, so
+ * one eval replaces ttguess.sh's tput and awk runs.  fp is NULL without
+ * a fingerprint match: then TERM is the --pick-term one or stays as it
+ * is, _TM_COLORS is 8 if DA1 says ANSI color (Ps 22) and 2 if not, and
+ * truecolor and emoji are 0, so the line is always complete.
+ */
+void
+init_print( const struct fprofile_s *fp, const char *terms )
+{
+    const char *mode[3] = { "", "semi", "colon" };
+    struct bytebuf term  = { NULL, 0, 0 };
+    struct bytebuf set   = { NULL, 0, 0 };
+    struct bytebuf names = { NULL, 0, 0 };
+    const char    *env;
+
+    if ( opt.picks.len ) {
+        terms = opt.picks.b;
+    }
+    if ( terms && pick_term( terms, &term ) ) {
+        bb_printf( &set, " TERM='%s'", term.b );
+        bb_printf( &names, " TERM" );
+    }
+    else if (   ( NULL == fp ) && ( env = getenv("TERM") ) && env[0]
+             && ( NULL == strchr( env, '\'' ) ) )
+    {
+        bb_printf( &set, " TERM='%s'", env );
+        bb_printf( &names, " TERM" );
+    }
+    if ( NULL == fp ) {
+        int p[32];
+        int n = csi_params( opt.reply[Q_DA1].b, opt.reply[Q_DA1].len, '?',
+                            'c', p, 32 );
+        int colors = 2;
+        for ( int cx = 1; cx < n; cx++ ) {
+            if ( 22 == p[cx] ) {
+                colors = 8;
+            }
+        }
+        bb_printf( &set, " _TM_COLORS=%d _TM_TRUECOLOR=0 _TM_EMOJI=0",
+                colors );
+        bb_printf( &names, " _TM_COLORS _TM_TRUECOLOR _TM_EMOJI" );
+    }
+    else {
+        if ( fp->truecolor ) {
+            bb_printf( &set, " COLORTERM='truecolor'" );
+            bb_printf( &names, " COLORTERM" );
+        }
+        bb_printf( &set, " _TM_COLORS=%u _TM_TRUECOLOR=%d _TM_EMOJI=%d",
+                fp->colors, fp->truecolor, fp->emoji );
+        bb_printf( &names, " _TM_COLORS _TM_TRUECOLOR _TM_EMOJI" );
+        if ( fp->truecolor && ( 0 < fp->mode ) && ( 3 > fp->mode ) ) {
+            bb_printf( &set, " _TM_TRUEMODE='%s'", mode[fp->mode] );
+            bb_printf( &names, " _TM_TRUEMODE" );
+        }
+        for ( const char *f = fp->flags; *f; ) {
+            size_t len = strcspn( f, " " );
+            if ( len ) {
+                bb_printf( &set, " _TM_" );
+                bb_printf( &names, " _TM_" );
+                for ( size_t cx = 0; cx < len; cx++ ) {
+                    bb_putc( &set, toupper( (unsigned char)f[cx] ) );
+                    bb_putc( &names, toupper( (unsigned char)f[cx] ) );
+                }
+                bb_printf( &set, "=1" );
+            }
+            f += len;
+            f += strspn( f, " " );
+        }
+    }
+    if ( set.len ) {
+        if ( INIT_SH == opt.init ) {
+            OUTPUT( "%s; export%s; \n", set.b + 1, names.b );
+        } else {
+            OUTPUT( "export%s; \n", set.b );
+        }
+    }
+    free( term.b );
+    free( set.b );
+    free( names.b );
+}
+
+/* Print the --identify result as shell variables */
+void
+identify_print()
+{
+    struct fprofile_s fp;
+    struct bytebuf terms = { NULL, 0, 0 };
+    struct bytebuf pick  = { NULL, 0, 0 };
+    const char *mode[3] = { "", "semi", "colon" };
+    int ix = opt.pcache_ix - 1;
+
+    if ( 0 <= ix ) {
+        /* Known from the DA1 reply, see pcache_load() */
+        fpdb_profile( ix, &fp );
+    }
+    else if ( 0 > ( ix = fp_lookup( &fp ) ) ) {
+        DEBUGOUT("No fingerprint database match%s\n", "" );
+        if ( opt.init ) {
+            init_print( NULL, NULL );
+        }
+        return;
+    }
+    else {
+        pcache_save( ix );
+    }
+    fp_terms( &fp, &terms );
+    if ( opt.init ) {
+        init_print( &fp, terms.b );
+        free( terms.b );
+        return;
+    }
+    OUTPUT( "TERMPROFILE='%s'; export TERMPROFILE; \n", fp.name );
+    OUTPUT( "TERMCANDS='%s'; export TERMCANDS; \n", terms.b );
+    if ( opt.pick_term && ( 0 == opt.picks.len )
+        && pick_term( terms.b, &pick ) )
+    {
+        OUTPUT( "TERM='%s'; export TERM; \n", pick.b );
+    }
+    free( pick.b );
+    free( terms.b );
+    OUTPUT( "_TM_EMOJI=%d; export _TM_EMOJI; \n", fp.emoji );
+    OUTPUT( "_TM_COLORS=%u; export _TM_COLORS; \n", fp.colors );
+    OUTPUT( "_TM_TRUECOLOR=%d; export _TM_TRUECOLOR; \n", fp.truecolor );
+    if ( fp.truecolor && ( 0 < fp.mode ) && ( 3 > fp.mode ) ) {
+        OUTPUT( "_TM_TRUEMODE='%s'; export _TM_TRUEMODE; \n",
+                mode[fp.mode] );
+    }
+    for ( const char *f = fp.flags; *f; ) {
+        size_t len = strcspn( f, " " );
+        char   name[32];
+        if ( len && ( len < sizeof(name) ) ) {
+            for ( size_t cx = 0; cx < len; cx++ ) {
+                name[cx] = toupper( (unsigned char)f[cx] );
+            }
+            name[len] = 0;
+            OUTPUT( "_TM_%s=1; export _TM_%s; \n", name, name );
+        }
+        f += len;
+        f += strspn( f, " " );
+    }
+}
+
+/***************************************
+ * Path of a file in termread's cache directory, $XDG_CACHE_HOME/termread
+ * (or ~/.cache/termread), made if need be.  Returns 0 without one.
+ */
+int
+cache_path( char *path, size_t size, const char *name )
+{
+    char  dir[PATH_MAX];
+    char *env;
+
+    if ( ( env = getenv("XDG_CACHE_HOME") ) && ( env[0] ) ) {
+        snprintf( dir, sizeof(dir), "%s", env );
+    } else if ( ( env = getenv("HOME") ) && ( env[0] ) ) {
+        snprintf( dir, sizeof(dir), "%s/.cache", env );
+    } else {
+        return 0;
+    }
+    mkdir( dir, 0700 );
+    strncat( dir, "/termread", sizeof(dir) - strlen(dir) - 1 );
+    if ( ( 0 != mkdir( dir, 0700 ) ) && ( EEXIST != errno ) ) {
+        DEBUGOUT("cache '%s': %s\n", dir, strerror(errno) );
+        return 0;
+    }
+    snprintf( path, size, "%s/%s", dir, name );
+    return 1;
+}
+
+/* Replace a cache file whole, so a reader never sees half of one */
+void
+cache_write( const char *path, const char *b, size_t len )
+{
+    char tmp[PATH_MAX + 16];
+    snprintf( tmp, sizeof(tmp), "%s.%ld", path, (long)getpid() );
+    int fd = open( tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600 );
+    if ( 0 > fd ) {
+        DEBUGOUT("cache '%s': %s\n", tmp, strerror(errno) );
+        return;
+    }
+    if ( ( (ssize_t)len != write( fd, b, len ) ) || ( 0 != close( fd ) )
+        || ( 0 != rename( tmp, path ) ) )
+    {
+        DEBUGOUT("cache '%s': %s\n", path, strerror(errno) );
+        unlink( tmp );
+    }
+}
+
+/* The DA1 and DA2 replies as one key, hashed (same form as the fpdb) */
+uint32_t
+fp_hash()
+{
+    struct bytebuf key = { NULL, 0, 0 };
+    fp_key_field( &key, '1', '=', opt.reply[Q_DA1].b ? opt.reply[Q_DA1].b : "",
+            opt.reply[Q_DA1].len );
+    fp_key_field( &key, '2', '=', opt.reply[Q_DA2].b ? opt.reply[Q_DA2].b : "",
+            opt.reply[Q_DA2].len );
+    uint32_t h = fnv1a( key.b, key.len );
+    free( key.b );
+    return h;
+}
+
+/* The ENQ, DA1, DA2 and DA3 replies fp_tuple() takes in, if asked */
+const enum query_e fp_tuple_q[] = { Q_ENQ, Q_DA1, Q_DA2, Q_DA3 };
+
+/* The replies collected so far as one key, hashed; 0 without a DA1 */
+int
+fp_tuple( uint32_t *h )
+{
+    static const char tag[Q_MAX] = {
+        [Q_ENQ] = 'E', [Q_DA1] = '1', [Q_DA2] = '2', [Q_DA3] = '3'
+    };
+    struct bytebuf key = { NULL, 0, 0 };
+
+    if ( opt.replay || ( 0 == opt.reply[Q_DA1].len ) ) {
+        return 0;
+    }
+    for ( int cx = 0; cx < 4; cx++ ) {
+        enum query_e q = fp_tuple_q[cx];
+        if ( opt.asked[q] ) {
+            fp_key_field( &key, tag[q], '=',
+                    opt.reply[q].b ? opt.reply[q].b : "", opt.reply[q].len );
+        }
+    }
+    *h = fnv1a( key.b, key.len );
+    free( key.b );
+    return 1;
+}
+
+/* The `kind` cache file for reply tuple hash h */
+int
+fp_cache_file( char *path, size_t size, const char *kind, uint32_t h )
+{
+    char name[32];
+    snprintf( name, sizeof(name), "%s.%08x", kind, h );
+    return cache_path( path, size, name );
+}
+
+/***************************************
+ * Profile cache, so a terminal seen before is known from its DA1 reply
+ * alone, without the DA2 or DA3 round trips (or the fpdb search) that
+ * told it apart the first time.  One file per DA1 reply and terminal
+ * environment ($TERM, $TERM_PROGRAM, $COLORTERM), profile.<hash> in
+ * the cache directory, a line for each profile a settled run found
+ * under it:
+ *
+ *     <profile> <fpdb serial> <profile index>
+ *
+ * Emulators that share a DA1 reply mostly set those variables apart.
+ * For those that don't, a file with two profiles on it is no shortcut:
+ * the planner asks on as if there were no cache.  --no-cache always
+ * asks and files what it found, so one such run puts a wrong guess
+ * right for good.  Lines from another fpdb serial are stale.  Runs
+ * DA1 alone settled aren't filed (nothing to save), nor any under
+ * --tty, where the environment is only this terminal's.
+ */
+int
+pcache_file( char *path, size_t size )
+{
+    static const char *env[] = { "TERM", "TERM_PROGRAM", "COLORTERM", NULL };
+    struct bytebuf key = { NULL, 0, 0 };
+    uint32_t h;
+
+    if ( opt.replay || opt.nttys || ( 0 == opt.reply[Q_DA1].len ) ) {
+        return 0;
+    }
+    fp_key_field( &key, '1', '=', opt.reply[Q_DA1].b, opt.reply[Q_DA1].len );
+    for ( int cx = 0; env[cx]; cx++ ) {
+        const char *v = getenv( env[cx] );
+        bb_printf( &key, "%s=%s\n", env[cx], v ? v : "" );
+    }
+    h = fnv1a( key.b, key.len );
+    free( key.b );
+    return fp_cache_file( path, size, "profile", h );
+}
+
+/* The current profiles filed in path, into ix[], returns how many */
+int
+pcache_read( const char *path, int *ix, int max )
+{
+    char      name[64];
+    unsigned  serial;
+    int       p;
+    int       n  = 0;
+    FILE     *fh = fopen( path, "r" );
+
+    if ( NULL == fh ) {
+        return 0;
+    }
+    while ( ( n < max ) && ( 3 == fscanf( fh, "%63s %u %d", name, &serial,
+                                           &p ) ) )
+    {
+        struct fprofile_s fp;
+        int dup = 0;
+        if (   ( serial != fpdb.serial ) || ( 0 > p )
+            || ( (uint32_t)p >= fpdb.nprofile ) )
+        {
+            continue;
+        }
+        fpdb_profile( p, &fp );
+        for ( int cx = 0; cx < n; cx++ ) {
+            dup |= ( ix[cx] == p );
+        }
+        if ( ( ! dup ) && ( 0 == strcmp( name, fp.name ) ) ) {
+            ix[n++] = p;
+        }
+    }
+    fclose( fh );
+    return n;
+}
+
+/***************************************
+ * Is the terminal known from its DA1 reply: one profile filed under
+ * it, and nothing else asked yet that could say otherwise.  plan_next()
+ * then has nothing left to ask.  Returns 1 if so.
+ */
+int
+pcache_load()
+{
+    char path[PATH_MAX];
+    int  ix[2];
+    int  n;
+
+    if (   opt.no_cache || opt.asked[Q_ENQ] || opt.asked[Q_DA2]
+        || opt.asked[Q_DA3] || ( ! pcache_file( path, sizeof(path) ) ) )
+    {
+        return 0;
+    }
+    if ( 1 != ( n = pcache_read( path, ix, 2 ) ) ) {
+        DEBUGOUT("profile cache %s, '%s'\n", n ? "shared" : "miss", path );
+        return 0;
+    }
+    DEBUGOUT("profile cache hit, '%s'\n", path );
+    opt.pcache_ix = ix[0] + 1;
+    opt.cnt.cache++;
+    return 1;
+}
+
+/* File fpdb profile ix under this DA1 reply, if the planner settled */
+void
+pcache_save( int ix )
+{
+    struct bytebuf    out = { NULL, 0, 0 };
+    struct fprofile_s fp;
+    char path[PATH_MAX];
+    int  old[8];
+    int  n;
+
+    if (   ( ! opt.plan_settled )
+        || ! ( opt.asked[Q_ENQ] || opt.asked[Q_DA2] || opt.asked[Q_DA3] )
+        || ( ! pcache_file( path, sizeof(path) ) ) )
+    {
+        return;
+    }
+    n = pcache_read( path, old, 7 );
+    for ( int cx = 0; cx < n; cx++ ) {
+        if ( ix == old[cx] ) {
+            return;
+        }
+    }
+    old[n++] = ix;
+    for ( int cx = 0; cx < n; cx++ ) {
+        fpdb_profile( old[cx], &fp );
+        bb_printf( &out, "%s %u %d\n", fp.name, fpdb.serial, old[cx] );
+    }
+    DEBUGOUT("profile cache: %s", out.b );
+    cache_write( path, out.b, out.len );
+    free( out.b );
+}
+
+/***************************************
+ * No-reply cache: the queries a terminal left unanswered, filed under
+ * the replies collected before each went out (fp_tuple()), in
+ * noreply.<hash>, a line each:
+ *
+ *     <qname> <expiry, seconds since the epoch>
+ *
+ * Until the expiry such a query goes out with a DA1 after it, and the
+ * DA1 reply (this terminal's is known by then) ends the wait instead
+ * of -d.  Nothing is skipped or assumed: whatever comes back ahead of
+ * the DA1 reply is the answer, so a terminal that does answer after
+ * all is read right, and taken off the list.  Only runs the planner
+ * settled are kept, and no unfenced misses under --budget, whose waits
+ * are cut short.  DA1 is the fence itself, and -p varies.  --record
+ * runs send no fence, so they replay the same.
+ */
+const char *noreply_name[Q_MAX] = {
+    [Q_ENQ] = "enq", [Q_DA2] = "term2", [Q_DA3] = "term3",
+    [Q_COLOR] = "color", [Q_BG] = "bg"
+};
+
+/* Read the noreply file for tuple hash h into exp[], 0 without one */
+int
+noreply_read( uint32_t h, long long *exp, char *path, size_t size )
+{
+    char   *line = NULL;
+    size_t  cap  = 0;
+    long long now = time( NULL );
+    FILE   *fh;
+
+    memset( exp, 0, sizeof(long long) * Q_MAX );
+    if ( ! fp_cache_file( path, size, "noreply", h ) ) {
+        return 0;
+    }
+    if ( ( fh = fopen( path, "r" ) ) ) {
+        while ( 0 < getline( &line, &cap, fh ) ) {
+            size_t len = strcspn( line, " " );
+            long long t = atoll( line + len );
+            for ( int q = 0; q < Q_MAX; q++ ) {
+                if (   noreply_name[q] && ( t > now )
+                    && ( strlen( noreply_name[q] ) == len )
+                    && ( 0 == strncmp( line, noreply_name[q], len ) ) )
+                {
+                    exp[q] = t;
+                }
+            }
+        }
+        free( line );
+        fclose( fh );
+    }
+    return 1;
+}
+
+/* Is query q (about to go out) one this terminal has left unanswered */
+int
+noreply_known( int q )
+{
+    char      path[PATH_MAX];
+    long long exp[Q_MAX];
+    uint32_t  h;
+
+    if (   opt.no_cache || opt.record || ( NULL == noreply_name[q] )
+        || ( ! fp_tuple( &h ) )
+        || ( ! noreply_read( h, exp, path, sizeof(path) ) )
+        || ( 0 == exp[q] ) )
+    {
+        return 0;
+    }
+    DEBUGOUT("%s: no reply cached until %lld, DA1 fenced\n",
+            noreply_name[q], exp[q] );
+    opt.cnt.cache++;
+    return 1;
+}
+
+/***************************************
+ * Take the DA1 fence reply off the end of opt.raw, leaving q's own
+ * reply, if any.  A DA2 reply can look just like the DA1 one, so only
+ * the last copy is the fence.  Returns 0 if the fence never came.
+ */
+int
+noreply_unfence()
+{
+    struct bytebuf *da = &opt.reply[Q_DA1];
+
+    if (   ( opt.raw.len < da->len )
+        || memcmp( opt.raw.b + opt.raw.len - da->len, da->b, da->len ) )
+    {
+        DEBUGOUT("DA1 fence reply missing%s\n", "" );
+        return 0;
+    }
+    opt.raw.len -= da->len;
+    return 1;
+}
+
+/* Note whether query q was answered, before its reply is filed, while
+ * fp_tuple() is still the key it went out under */
+void
+noreply_note( int q, int answered )
+{
+    if ( ( NULL == noreply_name[q] ) || ( ! fp_tuple( &opt.noreply_key[q] ) ) )
+    {
+        return;
+    }
+    opt.noreply_seen[q] = answered ? -1 : 1;
+}
+
+/***************************************
+ * Once the planner settled, write out what noreply_note() saw: a new
+ * miss is kept for NOREPLY_TTL, an answer drops the line.
+ */
+void
+noreply_save()
+{
+    char      path[PATH_MAX];
+    long long exp[Q_MAX];
+    long long old[Q_MAX];
+
+    if ( ! opt.plan_settled ) {
+        return;
+    }
+    for ( int q = 0; q < Q_MAX; q++ ) {
+        struct bytebuf out = { NULL, 0, 0 };
+        if (   ( 0 == opt.noreply_seen[q] )
+            || ( ! noreply_read( opt.noreply_key[q], exp, path,
+                                 sizeof(path) ) ) )
+        {
+            continue;
+        }
+        memcpy( old, exp, sizeof(old) );
+        if ( 0 > opt.noreply_seen[q] ) {
+            exp[q] = 0;
+        } else if ( 0 == exp[q] ) {
+            exp[q] = (long long)time( NULL ) + NOREPLY_TTL;
+        }
+        if ( old[q] == exp[q] ) {
+            continue;
+        }
+        for ( int x = 0; x < Q_MAX; x++ ) {
+            if ( exp[x] ) {
+                bb_printf( &out, "%s %lld\n", noreply_name[x], exp[x] );
+            }
+        }
+        DEBUGOUT("noreply cache: %s", out.len ? out.b : "empty\n" );
+        cache_write( path, out.b ? out.b : "", out.len );
+        free( out.b );
+    }
+}
+
+/***************************************
+ * --widths probes, in TERMWIDTHS order (README.md lists them).  Each
+ * is printed at column 1 and followed by a cursor report, the column
+ * it leaves the cursor at is its width.
+ */
+const char *width_probe[] = {
+    "\344\270\200",                 /* U+4E00 CJK */
+    "\352\260\200",                 /* U+AC00 Hangul */
+    "\357\274\241",                 /* U+FF21 fullwidth A */
+    "\342\221\240",                 /* U+2460 East Asian ambiguous */
+    "\360\237\230\200",             /* U+1F600 emoji */
+    "\360\237\253\240",             /* U+1FAE0 emoji, Unicode 14 */
+    "\342\235\244\357\270\217",     /* U+2764 U+FE0F emoji selector */
+    "\342\235\244",                 /* U+2764 text default */
+    "\360\237\207\272\360\237\207\270",     /* flag, regional pair */
+    "\360\237\221\213\360\237\217\275",     /* skin tone modifier */
+    "\360\237\221\250\342\200\215\360\237\221\251",    /* ZWJ pair */
+    "e\314\201",                    /* U+0301 combining */
+    "\342\200\213",                 /* U+200B zero width space */
+    NULL
+};
+#define WIDTH_EMOJI 4               /* width_probe[] index of U+1F600 */
+
+/***************************************
+ * --widths: every probe and its cursor report go out in one write,
+ * then an erase and a DA1, whose reply closes the batch even when
+ * some reports never come.  Widths are kept in the cache by
+ * fp_hash(), so a terminal is only measured the first time.
+ */
+void
+do_widths()
+{
+    struct bytebuf   q  = { NULL, 0, 0 };
+    struct replies_s r;
+    char       w[32];
+    char       name[32];
+    char       path[PATH_MAX];
+    int        n        = 0;
+    int        got      = 0;
+    int        row      = -1;
+    int        cached   = 0;
+    int        done     = 0;
+
+    memset( &r, 0, sizeof(r) );
+
+    while ( width_probe[n] ) {
+        w[n++] = '?';
+    }
+    w[n] = 0;
+    snprintf( name, sizeof(name), "widths.%08x", fp_hash() );
+    if ( ( ! opt.replay ) && cache_path( path, sizeof(path), name ) ) {
+        FILE *fh = opt.no_cache ? NULL : fopen( path, "r" );
+        char  line[sizeof(w) + 2] = { 0 };
+        if ( fh ) {
+            if (   fgets( line, sizeof(line), fh )
+                && ( (size_t)n == strspn( line, "0123456789?" ) )
+                && ( '\n' == line[n] ) )
+            {
+                memcpy( w, line, n );
+                cached = 1;
+                opt.cnt.cache++;
+            }
+            fclose( fh );
+        }
+    } else {
+        path[0] = 0;
+    }
+    DEBUGOUT("widths %s %s\n", name, cached ? "cached" : "measuring" );
+
+    if ( ( ! cached ) && opt.budget_end
+        && ( opt.budget_end - mono_us()
+             < ( opt.plan_rtt ? opt.plan_rtt : PLAN_RTT ) ) )
+    {
+        bb_printf( &opt.skipped, "%swidths", opt.skipped.len ? " " : "" );
+        free( q.b );
+        return;
+    }
+    if ( ! cached ) {
+        for ( int cx = 0; cx < n; cx++ ) {
+            bb_putc( &q, '\r' );
+            bb_put( &q, width_probe[cx], strlen( width_probe[cx] ) );
+            bb_put( &q, "\033[6n", 4 );
+        }
+        bb_put( &q, "\r\033[2K", 5 );
+        bb_put( &q, PRIMARY_DEV_ATTR, strlen( PRIMARY_DEV_ATTR ) );
+        opt.qname = "widths";
+        opt.qid   = Q_NONE;
+        initTermios(0);
+        /* CSI row ; col R is a cursor report only while they are due */
+        r.dm.finals = "R";
+        term_send( q.b, q.len, 1 );
+        opt.stat_t_listen = opt.stat_t_write;
+        r.deadline = opt.stat_t_write + ( opt.delay * 1000 );
+        while ( ( ! done ) && replies_next( &r ) ) {
+            int  y   = 0;
+            int  x   = 0;
+            char fin = 0;
+            if ( 'c' == r.rep.b[r.rep.len - 1] ) {
+                /* The DA1 after the last probe */
+                done = 1;
+            }
+            else if (   ( got < n )
+                     && ( 3 == sscanf( r.rep.b, "\033[%d;%d%c", &y, &x, &fin ) )
+                     && ( 'R' == fin ) )
+            {
+                if ( 0 > row ) {
+                    row = y;
+                }
+                /* Wrapped or scrolled, the column says nothing */
+                if ( ( y == row ) && ( 1 <= x ) && ( 10 >= x ) ) {
+                    w[got] = '0' + ( x - 1 );
+                }
+                got++;
+            }
+        }
+        demux_flush( &r.dm, &opt.typeahead );
+        resetTermios();
+        DEBUGOUT("widths: %d of %d reports, %s\n", got, n,
+                done ? "DA1 seen" : "timed out" );
+        if ( done && path[0] ) {
+            char line[sizeof(w) + 1];
+            snprintf( line, sizeof(line), "%s\n", w );
+            cache_write( path, line, n + 1 );
+        }
+    }
+    if ( cached || got ) {
+        OUTPUT( "TERMWIDTHS='%s'; export TERMWIDTHS; \n", w );
+        if ( '?' != w[WIDTH_EMOJI] ) {
+            OUTPUT( "_TM_EMOJIWIDTH=%c; export _TM_EMOJIWIDTH; \n",
+                    w[WIDTH_EMOJI] );
+        }
+    }
+    free( r.rep.b );
+    free( q.b );
+}
+
+/***************************************
+ * --rqss settings, in the order they are asked.  .q is the DECRQSS
+ * Pt, which a valid reply also ends with.
+ */
+struct rqss_s {
+    const char *q;
+    const char *name;
+    const char *var;
+} rqss[] = {
+    { "m",   "sgr",     "TERMRQSS_SGR" },     /* with a truecolor SGR set */
+    { "\"q", "decsca",  "TERMRQSS_DECSCA" },  /* character protection */
+    { " q",  "cursor",  "TERMRQSS_CURSOR" },  /* DECSCUSR cursor style */
+    { "r",   "margins", "TERMRQSS_MARGINS" }, /* DECSTBM top;bottom */
+    { "\"p", "level",   "TERMRQSS_LEVEL" },   /* DECSCL conformance level */
+};
+#define RQSS_N ( sizeof(rqss) / sizeof(rqss[0]) )
+#define RQSS_SGR "38;2;1;2;3"
+
+/***************************************
+ * --rqss: every DECRQSS (DCS $ q Pt ST) goes out in one write with a
+ * DA1 after them.  Replies are DCS 1 $ r ... ST for a setting or
+ * DCS 0 $ r ST for one not known, and the DA1 reply ends
+ * the batch, so a terminal without DECRQSS costs one round trip.  The
+ * SGR is asked with RQSS_SGR set, between DECSC and DECRC, to see if
+ * (and in which form) the terminal keeps a truecolor.
+ */
+void
+do_rqss()
+{
+    struct bytebuf   q = { NULL, 0, 0 };
+    struct replies_s r;
+    struct bytebuf   bad = { NULL, 0, 0 };
+    int              got = 0;
+    int              done = 0;
+    char             seen[RQSS_N];
+
+    memset( &r, 0, sizeof(r) );
+    memset( seen, 0, sizeof(seen) );
+    if ( 0 != is_vtxxx( opt.envterm ) ) {
+        fprintf( stderr,
+            "# Current effective TERM='%s', does not support --rqss\n",
+            opt.envterm );
+        return;
+    }
+    if ( opt.budget_end
+        && ( opt.budget_end - mono_us()
+             < ( opt.plan_rtt ? opt.plan_rtt : PLAN_RTT ) ) )
+    {
+        bb_printf( &opt.skipped, "%srqss", opt.skipped.len ? " " : "" );
+        return;
+    }
+    for ( int cx = 0; cx < RQSS_N; cx++ ) {
+        if ( 0 == cx ) {
+            bb_printf( &q, "\0337\033[" RQSS_SGR "m" );
+        }
+        bb_printf( &q, "\033P$q%s\033\\", rqss[cx].q );
+        if ( 0 == cx ) {
+            bb_printf( &q, "\0338" );
+        }
+    }
+    bb_put( &q, PRIMARY_DEV_ATTR, strlen( PRIMARY_DEV_ATTR ) );
+    opt.qname = "rqss";
+    opt.qid   = Q_NONE;
+    initTermios(0);
+    term_send( q.b, q.len, 1 );
+    opt.stat_t_listen = opt.stat_t_write;
+    r.deadline = opt.stat_t_write + ( opt.delay * 1000 );
+    while ( ( ! done ) && replies_next( &r ) ) {
+        const char *b   = r.rep.b;
+        size_t      len = r.rep.len;
+        if ( ( 3 < len ) && ( '[' == b[1] ) && ( 'c' == b[len - 1] ) ) {
+            done = 1;
+            continue;
+        }
+        /* ESC P Ps $ r Pt ESC \ */
+        if (   ( 7 > len ) || ( 'P' != b[1] ) || ( '$' != b[3] )
+            || ( 'r' != b[4] ) )
+        {
+            continue;
+        }
+        /*
+         * DCS 0 $ r ST names no setting, and a terminal may skip or
+         * reorder replies, so each one goes to the entry its Pt ends
+         * with; the longest .q wins.  Entries never matched end up in
+         * TERMRQSS_UNKNOWN.
+         */
+        const char    *pt = b + 5;
+        size_t         ln = len - 7;
+        struct rqss_s *k  = NULL;
+        size_t         ql = 0;
+        if ( '1' != b[2] ) {
+            continue;
+        }
+        for ( int cx = 0; cx < RQSS_N; cx++ ) {
+            size_t l = strlen( rqss[cx].q );
+            if ( ( ! seen[cx] ) && ( ql < l ) && ( l <= ln )
+                && ( 0 == memcmp( pt + ln - l, rqss[cx].q, l ) ) )
+            {
+                k  = &rqss[cx];
+                ql = l;
+            }
+        }
+        if ( NULL == k ) {
+            continue;
+        }
+        seen[k - rqss] = 1;
+        got++;
+        ln -= ql;
+        OUTPUT( "%s=", k->var );
+        reply_encode( &opt.outbuf, pt, ln, opt.enc );
+        OUTPUT( "; export %s; \n", k->var );
+        if ( 0 == strcmp( "m", k->q ) ) {
+            /* The same color back, in either form, is truecolor kept */
+            char sgr[64];
+            size_t sl = 0;
+            for ( size_t cx = 0; ( cx < ln ) && ( sl < sizeof(sgr) - 1 ); cx++ ) {
+                char c = ( ':' == pt[cx] ) ? ';' : pt[cx];
+                if ( ( ';' != c ) || ( 0 == sl ) || ( ';' != sgr[sl - 1] ) ) {
+                    sgr[sl++] = c;
+                }
+            }
+            sgr[sl] = 0;
+            int tc = ( NULL != strstr( sgr, RQSS_SGR ) );
+            OUTPUT( "TERMRQSS_TRUECOLOR=%d; export TERMRQSS_TRUECOLOR; \n",
+                    tc );
+            if ( tc ) {
+                OUTPUT( "TERMRQSS_TRUEMODE='%s'; export TERMRQSS_TRUEMODE; \n",
+                        memchr( pt, ':', ln ) ? "colon" : "semi" );
+            }
+        }
+    }
+    demux_flush( &r.dm, &opt.typeahead );
+    resetTermios();
+    DEBUGOUT("rqss: %d of %d replies, %s\n", got, (int)RQSS_N,
+            done ? "DA1 seen" : "timed out" );
+    for ( int cx = 0; cx < RQSS_N; cx++ ) {
+        if ( ! seen[cx] ) {
+            bb_printf( &bad, "%s%s", bad.len ? " " : "", rqss[cx].name );
+        }
+    }
+    if ( bad.len ) {
+        OUTPUT( "TERMRQSS_UNKNOWN='%s'; export TERMRQSS_UNKNOWN; \n", bad.b );
+    }
+    free( bad.b );
+    free( r.rep.b );
+    free( q.b );
+}
+
+/* Kitty keyboard protocol flag bits, as named in TERMKITTYKBD_NAMES */
+const char *kbd_flag[] = {
+    "disambiguate",     /* 1, escape codes that can't be confused */
+    "events",           /* 2, press, repeat and release */
+    "alternates",       /* 4, shifted and base layout keys */
+    "allkeys",          /* 8, every key as an escape code */
+    "text",             /* 16, the text a key produces */
+    NULL
+};
+
+/***************************************
+ * --kitty-keys: CSI ? u, answered CSI ? flags u by a terminal with
+ * the kitty keyboard protocol, then a DA1, which every terminal
+ * answers, to end the wait.  A DA1 reply alone means no protocol; after
+ * a run the planner settled, that is kept in kbd.<hash> (filed under
+ * fp_tuple(), like the profile cache) as "0 <expiry>", and not asked
+ * for again for NOREPLY_TTL.  The flags are whatever the running
+ * program last pushed.
+ */
+void
+do_kbd()
+{
+    struct bytebuf   q = { NULL, 0, 0 };
+    struct replies_s r;
+    char             path[PATH_MAX];
+    uint32_t         h;
+    int              flags = -1;
+    int              done = 0;
+
+    memset( &r, 0, sizeof(r) );
+    if ( 0 != is_vtxxx( opt.envterm ) ) {
+        fprintf( stderr,
+            "# Current effective TERM='%s', does not support --kitty-keys\n",
+            opt.envterm );
+        return;
+    }
+    if (   ( ! fp_tuple( &h ) )
+        || ( ! fp_cache_file( path, sizeof(path), "kbd", h ) ) )
+    {
+        path[0] = 0;
+    }
+    else if ( ! opt.no_cache ) {
+        FILE *fh = fopen( path, "r" );
+        int   v  = -1;
+        long long t = 0;
+        if ( fh ) {
+            done = ( 2 == fscanf( fh, "%d %lld", &v, &t ) ) && ( 0 == v )
+                && ( t > (long long)time( NULL ) );
+            opt.cnt.cache += done;
+            fclose( fh );
+        }
+    }
+    if ( done ) {
+        DEBUGOUT("kitty-keys: cached as not supported%s\n", "" );
+    }
+    else if ( opt.budget_end
+        && ( opt.budget_end - mono_us()
+             < ( opt.plan_rtt ? opt.plan_rtt : PLAN_RTT ) ) )
+    {
+        bb_printf( &opt.skipped, "%skbd", opt.skipped.len ? " " : "" );
+        return;
+    }
+    else {
+        bb_printf( &q, "\033[?u" );
+        bb_put( &q, PRIMARY_DEV_ATTR, strlen( PRIMARY_DEV_ATTR ) );
+        opt.qname = "kbd";
+        opt.qid   = Q_NONE;
+        initTermios(0);
+        term_send( q.b, q.len, 1 );
+        opt.stat_t_listen = opt.stat_t_write;
+        r.deadline = opt.stat_t_write + ( opt.delay * 1000 );
+        while ( ( ! done ) && replies_next( &r ) ) {
+            int p[1];
+            if ( 'c' == r.rep.b[r.rep.len - 1] ) {
+                done = 1;
+            }
+            else if ( 1 == csi_params( r.rep.b, r.rep.len, '?', 'u', p, 1 ) ) {
+                flags = p[0];
+            }
+        }
+        demux_flush( &r.dm, &opt.typeahead );
+        resetTermios();
+        DEBUGOUT("kitty-keys: flags %d, %s\n", flags,
+                done ? "DA1 seen" : "timed out" );
+        if ( done && ( 0 > flags ) && path[0] && opt.plan_settled ) {
+            char line[32];
+            int  len = snprintf( line, sizeof(line), "0 %lld\n",
+                                 (long long)time( NULL ) + NOREPLY_TTL );
+            cache_write( path, line, len );
+        }
+    }
+    if ( ! done && ( 0 > flags ) ) {
+        /* Nothing came back at all, so nothing is known */
+        free( r.rep.b );
+        free( q.b );
+        return;
+    }
+    OUTPUT( "TERMKITTYKBD=%d; export TERMKITTYKBD; \n", ( 0 <= flags ) );
+    if ( 0 <= flags ) {
+        OUTPUT( "TERMKITTYKBD_FLAGS=%d; export TERMKITTYKBD_FLAGS; \n",
+                flags );
+        OUTPUT( "TERMKITTYKBD_NAMES='" );
+        for ( int cx = 0, n = 0; kbd_flag[cx]; cx++ ) {
+            if ( flags & ( 1 << cx ) ) {
+                OUTPUT( "%s%s", n++ ? " " : "", kbd_flag[cx] );
+            }
+        }
+        OUTPUT( "'; export TERMKITTYKBD_NAMES; \n" );
+    }
+    free( r.rep.b );
+    free( q.b );
+}
+
+int
+do_term()
+{
+    struct bytebuf val = { NULL, 0, 0 };
+    long int got = 0;
+
+    for ( ;; ) {
+        enum query_e plan_q = Q_NONE;
+        /* --identify asks one query at a time, once the user's are done */
+        if (   opt.identify && ( ! opt.plan_stop )
+            && ( 0 == opt.reqenq + opt.termname + opt.term2da + opt.term3da ) )
+        {
+            switch ( plan_q = plan_next() ) {
+                case Q_ENQ: opt.reqenq   = 1; break;
+                case Q_DA1: opt.termname = 1; break;
+                case Q_DA2: opt.term2da  = 1; break;
+                case Q_DA3: opt.term3da  = 1; break;
+                default: break;
+            }
+        }
+        if ( 0 == (   opt.reqenq
+                    + opt.termname
+                    + opt.background
+                    + opt.getcolor
+                    + opt.term2da
+                    + opt.term3da
+                    + opt.print ) )
+        {
+            break;
+        }
+        opt.cnt_mark = opt.cnt;
+        if ( opt.prefetch ) {
+            /* Echo off before the query goes out, nothing to erase */
+            initTermios(0);
+        }
+        term_write();
+        if ( opt.q_skip ) {
+            if ( opt.prefetch ) {
+                resetTermios();
+            }
+            /* If the planner's own query didn't fit, or there isn't a
+             * round trip left, nothing later it could want will fit */
+            if (   ( opt.qid == plan_q )
+                || ( opt.budget_end - mono_us()
+                     < ( opt.plan_rtt ? opt.plan_rtt : PLAN_RTT ) ) )
+            {
+                opt.plan_stop = opt.identify;
+            }
+            opt.q_skip = 0;
+            opt.qid = Q_NONE;
+            opt.var = NULL;
+            continue;
+        }
+
+        readInput();
+        if ( opt.prefetch ) {
+            resetTermios();
+        }
+        mux_unwrap( &opt.raw );
+        int fenced = 0;
+        if ( opt.q_fence ) {
+            fenced = noreply_unfence();
+            opt.q_fence = 0;
+        }
+        val.len = 0;
+        if ( opt.raw.len ) {
+            reply_encode( &val, opt.raw.b, opt.raw.len, opt.enc );
+        }
+        got = val.len;
+        if ( mux_check() ) {
+            /* Same action again, same --var */
+            opt.termname = 1;
+            opt.qid = Q_NONE;
+            continue;
+        }
+        enum query_e qid = opt.qid;
+        if ( opt.qid ) {
+            if ( opt.raw.len || ( ! opt.budget ) || fenced ) {
+                noreply_note( opt.qid, 0 != opt.raw.len );
+            }
+            opt.reply[opt.qid].len = 0;
+            bb_put( &opt.reply[opt.qid], opt.raw.b ? opt.raw.b : "",
+                    opt.raw.len );
+            opt.asked[opt.qid] = 1;
+            opt.qid = Q_NONE;
+        }
+        if ( got && ( opt.stat_d_final > opt.plan_rtt ) ) {
+            opt.plan_rtt = opt.stat_d_final;
+        }
+
+        if ( ! opt.prefetch ) {
+            term_cleanline();
+        }
+
+        if ( got ) {
+            OUTPUT( "%s=", opt.var );
+            bb_put( &opt.outbuf, val.b, val.len );
+            OUTPUT( "; export %s; \n", opt.var );
+            if ( opt.decode ) {
+                reply_decode( qid, opt.raw.b, opt.raw.len, &opt.outbuf );
+            }
+        }
+        opt.var = NULL;
+
+        if ( opt.wantstat ) {
+            stats_print( got );
+        }
+    }
+    noreply_save();
+
+    if ( opt.widths ) {
+        opt.cnt_mark = opt.cnt;
+        do_widths();
+        counts_action( "widths" );
+    }
+    if ( opt.rqss ) {
+        opt.cnt_mark = opt.cnt;
+        do_rqss();
+        counts_action( "rqss" );
+    }
+    if ( opt.kbd ) {
+        opt.cnt_mark = opt.cnt;
+        do_kbd();
+        counts_action( "kbd" );
+    }
+    if ( opt.skipped.len ) {
+        OUTPUT( "TERMREAD_SKIPPED='%s'; export TERMREAD_SKIPPED; \n",
+                opt.skipped.b );
+    }
+    if ( opt.init ) {
+        /* Only the --init line, the raw replies are no use to an rc */
+        opt.outbuf.len = 0;
+    }
+    typeahead_handoff( STDIN_FILENO, &opt.typeahead, &opt.outbuf );
+    if ( opt.identify ) {
+        identify_print();
+    }
+    if ( opt.pick_term && opt.picks.len && ( ! opt.init ) ) {
+        struct bytebuf pick = { NULL, 0, 0 };
+        if ( pick_term( opt.picks.b, &pick ) ) {
+            OUTPUT( "TERM='%s'; export TERM; \n", pick.b );
+        }
+        free( pick.b );
+    }
+
+    term_close();
+    if ( opt.recfh ) {
+        fclose( opt.recfh );
+        opt.recfh = NULL;
+    }
+
+    return 0;
+}
+
+/* Swap a --tty device's replies in, for plan_next() and fp_lookup() */
+void
+tty_load( struct ttydev_s *d )
+{
+    memcpy( opt.reply, d->reply, sizeof(opt.reply) );
+    memcpy( opt.asked, d->asked, sizeof(opt.asked) );
+    opt.plan_settled = d->settled;
+}
+
+/***************************************
+ * Send device d its next query: the shared list first, then whatever
+ * the --identify planner wants for this device.  Marks it done when
+ * there is nothing left (or it can't be written).
+ */
+void
+tty_send( struct ttydev_s *d, struct ttyq_s *list, int nlist )
+{
+    struct bytebuf q = { NULL, 0, 0 };
+    const char *b = NULL;
+    size_t len = 0;
+
+    d->qid = Q_NONE;
+    if ( d->next < nlist ) {
+        struct ttyq_s *tq = &list[d->next++];
+        d->qid   = tq->qid;
+        d->qname = tq->qname;
+        d->var   = tq->var;
+        b        = tq->q.b;
+        len      = tq->q.len;
+    }
+    else if ( opt.identify ) {
+        tty_load( d );
+        switch ( plan_next() ) {
+            case Q_ENQ: opt.reqenq   = 1; break;
+            case Q_DA1: opt.termname = 1; break;
+            case Q_DA2: opt.term2da  = 1; break;
+            case Q_DA3: opt.term3da  = 1; break;
+            default: break;
+        }
+        d->settled = opt.plan_settled;
+        if ( term_next( &q ) ) {
+            d->qid   = opt.qid;
+            d->qname = opt.qname;
+            d->var   = opt.var;
+            b        = q.b;
+            len      = q.len;
+        }
+        opt.var = NULL;
+    }
+    if ( Q_NONE == d->qid ) {
+        d->done = 1;
+        return;
+    }
+    if ( opt.budget && ( opt.budget_end - mono_us() < PLAN_RTT ) ) {
+        /* Out of --budget: this and the rest of the list are skipped */
+        bb_printf( &d->skipped, "%s", d->qname );
+        for ( ; d->next < nlist; d->next++ ) {
+            bb_printf( &d->skipped, " %s", list[d->next].qname );
+        }
+        d->done = 1;
+        free( q.b );
+        return;
+    }
+
+    d->t_write  = mono_us();
+    d->t_first  = 0;
+    d->deadline = d->t_write + ( opt.delay * 1000 );
+    if ( opt.budget_end && ( opt.budget_end < d->deadline ) ) {
+        d->deadline = opt.budget_end;
+    }
+    d->chunks   = 0;
+    d->reply[d->qid].len = 0;
+    for ( size_t off = 0; off < len; ) {
+        ssize_t wr = cnt_write( d->fd, b + off, len - off );
+        if ( 0 > wr ) {
+            if ( ( EINTR == errno ) || ( EAGAIN == errno ) ) {
+                continue;
+            }
+            fprintf( stderr, "Unable to write '%s': %s\n", d->path,
+                    strerror(errno) );
+            d->done = 1;
+            break;
+        }
+        off += wr;
+    }
+    free( q.b );
+}
+
+/* The reply to d's current query is in (or timed out), move on */
+void
+tty_finish( struct ttydev_s *d, struct ttyq_s *list, int nlist )
+{
+    demux_flush( &d->dm, &d->typeahead );
+    d->asked[d->qid] = 1;
+    d->val.len = 0;
+    if ( d->reply[d->qid].len ) {
+        reply_encode( &d->val, d->reply[d->qid].b, d->reply[d->qid].len,
+                      opt.enc );
+        bb_printf( &d->out, "%s=", d->var );
+        bb_put( &d->out, d->val.b, d->val.len );
+        bb_printf( &d->out, "; export %s; \n", d->var );
+        if ( opt.decode ) {
+            reply_decode( d->qid, d->reply[d->qid].b, d->reply[d->qid].len,
+                          &d->out );
+        }
+    }
+    if ( opt.wantstat ) {
+        bb_printf( &d->out, "# %s : length : %zu, chunks : %d, "
+                "write_to_read : %lld us, complete : %lld us\n", d->qname,
+                d->val.len, d->chunks,
+                d->chunks ? d->t_first - d->t_write : 0LL,
+                d->chunks ? d->t_last - d->t_write : 0LL );
+    }
+    if ( ! d->done ) {
+        tty_send( d, list, nlist );
+    }
+}
+
+/***************************************
+ * Bytes read from d at now, for its current query.  Past a reply's
+ * terminator they belong to the next query, sent by tty_finish(): kept
+ * and taken for it, as readInput() carries them.
+ */
+void
+tty_take( struct ttydev_s *d, struct ttyq_s *list, int nlist,
+          const char *chunk, size_t len, long long now )
+{
+    struct bytebuf rb   = { NULL, 0, 0 };
+    struct bytebuf next = { NULL, 0, 0 };
+
+    while ( len && ( ! d->done ) ) {
+        const char *data = chunk;
+        size_t      got  = len;
+        size_t      used = 0;
+        int         done = 0;
+        if ( ( Q_ENQ != d->qid ) && ( Q_PRINT != d->qid ) ) {
+            rb.len = 0;
+            for ( size_t cx = 0; cx < len; cx++ ) {
+                demux_byte( &d->dm, chunk[cx], &rb, &d->typeahead );
+            }
+            if ( 0 == rb.len ) {
+                break;
+            }
+            data = rb.b;
+            got  = rb.len;
+        }
+        if ( 0 == d->chunks++ ) {
+            d->t_first = now;
+        }
+        used = reply_take( data, got, &d->reply[d->qid], REPLY_MAX, &done );
+        d->t_last   = now;
+        d->deadline = now + WAIT_FOR_MORE;
+        if ( opt.budget_end && ( opt.budget_end < d->deadline ) ) {
+            d->deadline = opt.budget_end;
+        }
+        if ( 0 == done ) {
+            break;
+        }
+        if ( 2 == done ) {
+            fprintf( stderr, "# %s: reply to %s cut at %d bytes, the rest "
+                    "dropped\n", d->path, d->qname, REPLY_MAX );
+            used = got;
+        }
+        next.len = 0;
+        bb_put( &next, data + used, got - used );
+        d->carry.len = 0;
+        bb_put( &d->carry, next.b, next.len );
+        chunk = d->carry.b;
+        len   = d->carry.len;
+        tty_finish( d, list, nlist );
+    }
+    free( rb.b );
+    free( next.b );
+}
+
+/***************************************
+ * Wait until a --tty device is readable or timeout_ms passes, put the
+ * ready device indexes in ready[].  epoll(7) on Linux, poll(2)
+ * elsewhere.  Returns how many are ready.
+ */
+int
+ttys_wait( int ep, struct ttydev_s *dev, int ndev, int timeout_ms,
+           int *ready )
+{
+    int n = 0;
+#ifdef __linux__
+    struct epoll_event ev[64];
+    int got = epoll_wait( ep, ev, 64, timeout_ms );
+    opt.cnt.poll++;
+    opt.cnt.empty += ( 0 >= got );
+    for ( int cx = 0; cx < got; cx++ ) {
+        ready[n++] = ev[cx].data.u32;
+    }
+#else
+    struct pollfd *pfd = calloc( ndev, sizeof(*pfd) );
+    int           *ix  = calloc( ndev, sizeof(*ix) );
+    int            np  = 0;
+    if ( ( NULL == pfd ) || ( NULL == ix ) ) {
+        exit( 1 );
+    }
+    for ( int cx = 0; cx < ndev; cx++ ) {
+        if ( ! dev[cx].done ) {
+            pfd[np].fd     = dev[cx].fd;
+            pfd[np].events = POLLIN;
+            ix[np++]       = cx;
+        }
+    }
+    if ( 0 < cnt_poll( pfd, np, timeout_ms ) ) {
+        for ( int cx = 0; cx < np; cx++ ) {
+            if ( pfd[cx].revents ) {
+                ready[n++] = ix[cx];
+            }
+        }
+    }
+    free( pfd );
+    free( ix );
+#endif
+    return n;
+}
+
+/***************************************
+ * Probe every --tty device at once.  Each device steps through the
+ * same queries on its own (one outstanding at a time, with its own
+ * --delay deadline), all driven from a single wait loop, so N devices
+ * take about as long as the slowest one rather than N times as long.
+ *
+ * Echo is off on each device before its first query goes out, so
+ * unlike do_term() there is no line to erase afterwards (which would
+ * land on whatever else is in that pane).
+ *
+ * Another pane's $TERM can't be read from here, so every device is
+ * asked what this one's $TERM allows (or, with !, what xterm does).
+ */
+int
+do_ttys()
+{
+    struct ttydev_s *dev  = calloc( opt.nttys, sizeof(*dev) );
+    struct ttyq_s   *list = calloc( 8, sizeof(*list) );
+    int   *ready = calloc( opt.nttys, sizeof(int) );
+    int    nlist = 0;
+    int    live  = 0;
+    int    ep    = -1;
+    char   chunk[256];
+
+    if ( ( NULL == dev ) || ( NULL == list ) || ( NULL == ready ) ) {
+        exit( 1 );
+    }
+    /* The user's actions, built once, in the usual order */
+    while ( ( nlist < 8 ) && term_next( &list[nlist].q ) ) {
+        if ( Q_PRINT == opt.qid ) {
+            bb_put( &list[nlist].q, opt.print_b, opt.print_len );
+        }
+        list[nlist].qid   = opt.qid;
+        list[nlist].qname = opt.qname;
+        list[nlist].var   = opt.var;
+        opt.var = NULL;
+        nlist++;
+    }
+#ifdef __linux__
+    ep = epoll_create1( EPOLL_CLOEXEC );
+    if ( 0 > ep ) {
+        fprintf( stderr, "epoll: %s\n", strerror(errno) );
+        exit( 1 );
+    }
+#endif
+
+    for ( int cx = 0; cx < opt.nttys; cx++ ) {
+        struct ttydev_s *d = &dev[cx];
+        struct termios   raw;
+        d->path = opt.ttys[cx];
+        d->fd   = open( d->path, O_RDWR|O_NOCTTY|O_NONBLOCK );
+        if ( 0 > d->fd ) {
+            fprintf( stderr, "Unable to open '%s': %s\n", d->path,
+                    strerror(errno) );
+            d->done = 1;
+            continue;
+        }
+        if ( 0 == tcgetattr( d->fd, &d->orig ) ) {
+            raw = d->orig;
+            raw.c_lflag &= ~( ICANON | ECHO );
+            d->saved = ( 0 == cnt_tcsetattr( d->fd, TCSANOW, &raw ) );
+        }
+#ifdef __linux__
+        struct epoll_event ev = { .events = EPOLLIN, .data.u32 = cx };
+        if ( epoll_ctl( ep, EPOLL_CTL_ADD, d->fd, &ev ) ) {
+            fprintf( stderr, "epoll: '%s': %s\n", d->path, strerror(errno) );
+            d->done = 1;
+            continue;
+        }
+#endif
+        tty_send( d, list, nlist );
+    }
+
+    for ( ;; ) {
+        long long now  = mono_us();
+        long long wake = 0;
+        live = 0;
+        for ( int cx = 0; cx < opt.nttys; cx++ ) {
+            struct ttydev_s *d = &dev[cx];
+            while ( ( ! d->done ) && ( now >= d->deadline ) ) {
+                tty_finish( d, list, nlist );
+            }
+            if ( d->done ) {
+                continue;
+            }
+            live++;
+            if ( ( 0 == wake ) || ( d->deadline < wake ) ) {
+                wake = d->deadline;
+            }
+        }
+        if ( 0 == live ) {
+            break;
+        }
+
+        int n = ttys_wait( ep, dev, opt.nttys,
+                           (int)( ( wake - now + 999 ) / 1000 ), ready );
+        for ( int rx = 0; rx < n; rx++ ) {
+            struct ttydev_s *d = &dev[ready[rx]];
+            ssize_t got = cnt_read( d->fd, chunk, sizeof(chunk) );
+            if ( ( 0 > got ) && ( ( EAGAIN == errno ) || ( EINTR == errno ) ) ) {
+                continue;
+            }
+            if ( d->done || ( 0 >= got ) ) {
+                /* Late reply to a finished device, or the device went away */
+                if ( ( 0 >= got ) && ( ! d->done ) ) {
+                    d->done = 1;
+                    tty_finish( d, list, nlist );
+                }
+#ifdef __linux__
+                epoll_ctl( ep, EPOLL_CTL_DEL, d->fd, NULL );
+#endif
+                continue;
+            }
+            tty_take( d, list, nlist, chunk, got, mono_us() );
+        }
+    }
+
+    for ( int cx = 0; cx < opt.nttys; cx++ ) {
+        struct ttydev_s *d = &dev[cx];
+        if ( d->saved ) {
+            cnt_tcsetattr( d->fd, TCSANOW, &d->orig );
+        }
+        if ( 0 <= d->fd ) {
+            typeahead_handoff( d->fd, &d->typeahead, &d->out );
+            close( d->fd );
+        }
+        OUTPUT( "# %s\n", d->path );
+        bb_put( &opt.outbuf, d->out.b ? d->out.b : "", d->out.len );
+        if ( d->skipped.len ) {
+            OUTPUT( "TERMREAD_SKIPPED='%s'; export TERMREAD_SKIPPED; \n",
+                    d->skipped.b );
+        }
+        if ( opt.identify ) {
+            tty_load( d );
+            identify_print();
+        }
+    }
+#ifdef __linux__
+    close( ep );
+#endif
+    return 0;
+}
+
+/***************************************
+ * Path of this session's --prefetch slot, plus suffix, in
+ * $XDG_RUNTIME_DIR/termread (or /tmp/termread-<uid>).  Keyed by
+ * session id, which the shell and everything it starts share.
+ * Returns 0 if the directory isn't private to this user.
+ */
+int
+slot_path( char *path, size_t size, const char *suffix )
+{
+    char        dir[PATH_MAX];
+    char       *env = getenv("XDG_RUNTIME_DIR");
+    struct stat st;
+
+    if ( env && env[0] ) {
+        snprintf( dir, sizeof(dir), "%s/termread", env );
+    } else {
+        snprintf( dir, sizeof(dir), "/tmp/termread-%u", (unsigned)getuid() );
+    }
+    if ( ( 0 != mkdir( dir, 0700 ) ) && ( EEXIST != errno ) ) {
+        fprintf( stderr, "Unable to create '%s': %s\n", dir,
+                strerror(errno) );
+        return 0;
+    }
+    if (   ( 0 != lstat( dir, &st ) ) || ( ! S_ISDIR( st.st_mode ) )
+        || ( st.st_uid != getuid() ) || ( st.st_mode & 077 ) )
+    {
+        fprintf( stderr, "Not using '%s', it is not a private directory\n",
+                dir );
+        return 0;
+    }
+    snprintf( path, size, "%s/slot.%ld%s", dir, (long)getsid( 0 ), suffix );
+    return 1;
+}
+
+/***************************************
+ * --prefetch: lock the session slot, then fork.  The parent returns 1
+ * straight away (and exits).  The child inherits the lock, sends its
+ * output to the slot's .tmp file and returns 0 to go on asking, see
+ * slot_done().
+ */
+int
+slot_prefetch()
+{
+    char   lock[PATH_MAX];
+    char   tmp[PATH_MAX + 8];
+    pid_t  pid;
+    int    fd;
+
+    if ( NULL == opt.term ) {
+        fprintf( stderr, "--prefetch needs the terminal on stdin.\n" );
+        exit( 1 );
+    }
+    if (   ( ! slot_path( lock, sizeof(lock), ".lock" ) )
+        || ( ! slot_path( opt.slot, sizeof(opt.slot), "" ) ) )
+    {
+        exit( 1 );
+    }
+    snprintf( tmp, sizeof(tmp), "%s.tmp", opt.slot );
+    opt.slot_lock = open( lock, O_RDWR|O_CREAT, 0600 );
+    if ( ( 0 > opt.slot_lock ) || ( 0 != flock( opt.slot_lock, LOCK_EX ) ) ) {
+        fprintf( stderr, "Unable to lock '%s': %s\n", lock, strerror(errno) );
+        exit( 1 );
+    }
+    unlink( opt.slot );     /* whatever an earlier --prefetch left */
+    out_flush();
+    pid = fork();
+    if ( 0 > pid ) {
+        fprintf( stderr, "Unable to fork: %s\n", strerror(errno) );
+        exit( 1 );
+    }
+    if ( pid ) {
+        DEBUGOUT("--prefetch asking from pid %ld\n", (long)pid );
+        return 1;
+    }
+    fd = open( tmp, O_WRONLY|O_CREAT|O_TRUNC, 0600 );
+    if ( ( 0 > fd ) || ( 0 > dup2( fd, STDOUT_FILENO ) ) ) {
+        fprintf( stderr, "Unable to open '%s': %s\n", tmp, strerror(errno) );
+        exit( 1 );
+    }
+    close( fd );
+    /* Off the shell's job control: in a session of our own the tty is
+     * not our controlling terminal, so reading it never stops us */
+    setsid();
+    fd = open( opt.term, O_RDWR|O_NOCTTY );
+    if ( ( 0 > fd ) || ( 0 > dup2( fd, STDIN_FILENO ) ) ) {
+        fprintf( stderr, "Unable to open '%s': %s\n", opt.term,
+                strerror(errno) );
+        exit( 1 );
+    }
+    close( fd );
+    return 0;
+}
+
+/* --prefetch child: publish the slot, then let --collect in */
+void
+slot_done()
+{
+    char tmp[PATH_MAX + 8];
+
+    out_flush();
+    snprintf( tmp, sizeof(tmp), "%s.tmp", opt.slot );
+    if ( 0 != rename( tmp, opt.slot ) ) {
+        fprintf( stderr, "Unable to rename '%s': %s\n", tmp,
+                strerror(errno) );
+    }
+    close( opt.slot_lock );
+}
+
+/***************************************
+ * --collect: wait out any --prefetch still asking (it holds the lock),
+ * then print this session's slot and remove it.  Returns the exit
+ * status, 1 when there was nothing to collect.
+ */
+int
+slot_collect()
+{
+    char    lock[PATH_MAX];
+    char    path[PATH_MAX];
+    char    chunk[4096];
+    ssize_t got;
+    int     lk;
+    int     fd;
+
+    if (   ( ! slot_path( lock, sizeof(lock), ".lock" ) )
+        || ( ! slot_path( path, sizeof(path), "" ) ) )
+    {
+        return 1;
+    }
+    lk = open( lock, O_RDWR );
+    if ( 0 <= lk ) {
+        flock( lk, LOCK_EX );
+    }
+    fd = open( path, O_RDONLY );
+    if ( 0 > fd ) {
+        DEBUGOUT("Nothing to collect in '%s'\n", path );
+        if ( 0 <= lk ) {
+            close( lk );
+        }
+        return 1;
+    }
+    while ( 0 < ( got = read( fd, chunk, sizeof(chunk) ) ) ) {
+        bb_put( &opt.outbuf, chunk, got );
+    }
+    close( fd );
+    unlink( path );
+    if ( 0 <= lk ) {
+        close( lk );
+    }
+    return 0;
+}
+
+int
+main( int argc, char *argv[], char *env[] )
+{
+    atexit( out_flush );
+    args( argc, argv );
+    if ( opt.budget ) {
+        opt.budget_end = mono_us() + ( opt.budget * 1000 );
+    }
+
+    if ( opt.wanthelp ) {
+        prinhelp();
+        exit( 0 );
+    }
+    else if ( opt.needhelp ) {
+        prinusage();
+        exit( 1 );
+    }
+    else if ( opt.wantlicense ) {
+        printlicense();
+        exit( 0 );
+    }
+    else if ( opt.wantversion ) {
+        prinversion();
+        exit( 0 );
+    }
+    else if ( opt.justerase ) {
+        term_cleanline();
+        exit( 0 );
+    }
+    else if ( opt.collect ) {
+        exit( slot_collect() );
+    }
+
+    if ( opt.replay ) {
+        replay_load();
+    }
+    if ( opt.record ) {
+        rec_open();
+    }
+
+    if ( opt.nttys ) {
+        do_ttys();
+        counts_action( "session" );
+    } else {
+        mux_detect();
+        if ( opt.prefetch && slot_prefetch() ) {
+            return(0);
+        }
+        if ( opt.ping ) {
+            int ret = do_ping();
+            counts_action( "session" );
+            exit( ret );
+        }
+        do_term();
+        counts_action( "session" );
+        if ( opt.prefetch ) {
+            slot_done();
+        }
+    }
 
     return(0);
 }
@@ -39,6 +39,9 @@
 #include <ctype.h>
 #include <string.h>
 #include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/ioctl.h>
 
 const char xt_eraseline[] = "\033[9D\033[2K";
 
@@ -61,6 +64,9 @@ struct tc_options_s {
     int      reset;
     int      text_output;
     int      mode;
+    int      bench;
+    int      bench_cols;
+    int      bench_rows;
     int      red[2];
     int      green[2];
     int      blue[2];
@@ -139,6 +145,16 @@ dohelp( struct tc_options_s *opts )
         "        Instead of opening the current TTY, output direct to stdout\n"
     );
     fprintf(out, "\n" );
+    fprintf(out, "    --bench[=<frames>]\n" );
+    fprintf(out, "        Fill the screen with truecolor cells <frames> times\n");
+    fprintf(out, "        (default 10), then ask for Device Attributes.  The\n");
+    fprintf(out, "        reply can't come back until every cell before it\n");
+    fprintf(out, "        is parsed, so this times the terminal's throughput.\n");
+    fprintf(out, "        Prints bytes, cells and frames per second.\n");
+    fprintf(out, "\n" );
+    fprintf(out, "    --bench-size=<cols>x<rows>\n" );
+    fprintf(out, "        Frame size for --bench.  Default: the window size.\n");
+    fprintf(out, "\n" );
     fprintf(out, "    --reset | -s\n" );
     fprintf(out, "        Terminal `ansi` reset will print at the end.\n" );
     fprintf(out, "\n" );
@@ -1414,6 +1430,31 @@ getOpts( char **argv, char **env )
                         argv[cx], opts->reset );
             }
             else
+            if ( ( argindex = _countmatch( "--bench", argv[cx], 7 ) ) ) {
+                opts->bench = 10;
+                if ( argv[cx][argindex] ) {
+                    opts->bench = (int)strtol( argv[cx]+argindex, NULL, 10 );
+                }
+                if ( 0 >= opts->bench ) {
+                    opts->needhelp = 1;
+                    fprintf(stderr, "Bad frame count in '%s'\n", argv[cx] );
+                }
+                debug( "Bench option '%s' set to %d frames\n",
+                        argv[cx], opts->bench );
+            }
+            else
+            if ( ( argindex = _countmatch( "--bench-size", argv[cx], 8 ) ) ) {
+                if ( 2 != sscanf( argv[cx]+argindex, "%dx%d",
+                            &opts->bench_cols, &opts->bench_rows )
+                    || ( 0 >= opts->bench_cols ) || ( 0 >= opts->bench_rows ) )
+                {
+                    opts->needhelp = 1;
+                    fprintf(stderr, "Expected COLSxROWS in '%s'\n", argv[cx] );
+                }
+                debug( "Bench size '%s' set to %dx%d\n",
+                        argv[cx], opts->bench_cols, opts->bench_rows );
+            }
+            else
             if ( ( argindex = _countmatch( "--mode", argv[cx], 3 ) ) ) {
                 if ( argv[cx][argindex] ) {
                     if ( 'c' == argv[cx][argindex] ) {
@@ -1921,6 +1962,175 @@ termcap_match( const char *buf, const char *match )
     return 0;
 }
 
+/***************************************
+ * --bench
+ *
+ * A terminal answers Device Attributes in order, so a DA1 sent after
+ * a flood of colored cells can't be answered until all of them have
+ * been parsed.  A bare DA1 first gives the round trip to take off.
+ */
+long long
+bench_now( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    /* 32 bit long would wrap after 35 minutes of uptime */
+    return ( ts.tv_sec * 1000000LL ) + ( ts.tv_nsec / 1000 );
+}
+
+/* Wait for the DA1 reply (ESC [ ? ... c), returns microseconds or -1 */
+long int
+bench_wait( long long start, long int limit )
+{
+    unsigned char c;
+    int state = 0;
+    for (;;) {
+        long long left = limit - ( bench_now() - start );
+        if ( 0 >= left ) {
+            return -1;
+        }
+        struct pollfd pfd = { .fd = 0, .events = POLLIN };
+        int ret = poll( &pfd, 1, (int)( ( left + 999 ) / 1000 ) );
+        if ( ( 0 > ret ) && ( EINTR != errno ) ) {
+            return -1;
+        }
+        while ( 1 == read( 0, &c, 1 ) ) {
+            if ( 033 == c ) {
+                state = 1;
+            } else if ( ( 1 == state ) && ( '[' == c ) ) {
+                state = 2;
+            } else if ( ( 2 == state ) && ( '?' == c ) ) {
+                state = 3;
+            } else if ( ( 3 == state ) && ( 'c' == c ) ) {
+                return (long int)( bench_now() - start );
+            } else if ( ( 3 != state )
+                    || ( ( ';' != c ) && ( ! isdigit( c ) ) ) ) {
+                state = 0;
+            }
+        }
+    }
+}
+
+int
+bench_send( int fd, const char *buf, size_t len )
+{
+    while ( len ) {
+        ssize_t ret = write( fd, buf, len );
+        if ( 0 > ret ) {
+            if ( ( EINTR == errno ) || ( EAGAIN == errno ) ) {
+                continue;
+            }
+            fprintf( stderr, "# ERROR: Write failed: %s\n", strerror(errno) );
+            return 0;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return 1;
+}
+
+int
+do_bench( int mode )
+{
+    int cols = Opts->bench_cols;
+    int rows = Opts->bench_rows;
+    if ( ( Opts->no_input ) || ( Opts->std_out ) ) {
+        fprintf( stderr, "# ERROR: Not on tty, cannot run benchmark.\n" );
+        return 1;
+    }
+    term_open();
+    int fd = fileno( Opts->termfh );
+    if ( ( 0 >= cols ) || ( 0 >= rows ) ) {
+        struct winsize ws;
+        cols = 80;
+        rows = 24;
+        if ( ( 0 == ioctl( fd, TIOCGWINSZ, &ws ) ) && ( ws.ws_col ) ) {
+            cols = ws.ws_col;
+            rows = ws.ws_row;
+        }
+    }
+
+    /* Longest cell: ESC[38;2;255;255;255;48;2;255;255;255mX */
+    size_t cell = 40;
+    size_t room = (size_t)Opts->bench
+                * ( ( (size_t)rows * ( 16 + ( cell * cols ) ) ) + 8 );
+    char *buf = malloc( room );
+    if ( NULL == buf ) {
+        fatal( "Out of memory. %s:%d\n", __FILE__, __LINE__-2 );
+    }
+    const char *sgr = mode ? "\033[38;2;%d;%d;%d;48;2;%d;%d;%dm%c"
+                           : "\033[38:2::%d:%d:%d;48:2::%d:%d:%dm%c";
+    size_t len = 0;
+    for ( int f = 0; f < Opts->bench; f++ ) {
+        for ( int y = 0; y < rows; y++ ) {
+            len += snprintf( buf + len, room - len, "\033[%d;1H", y + 1 );
+            for ( int x = 0; x < cols; x++ ) {
+                /* Every cell of every frame changes color */
+                int r = ( ( x * 255 / cols ) + ( f * 17 ) ) & 255;
+                int g = ( ( y * 255 / rows ) + ( f * 29 ) ) & 255;
+                int b = ( x + y + ( f * 7 ) ) & 255;
+                len += snprintf( buf + len, room - len, sgr,
+                        255 - r, 255 - g, 255 - b, r, g, b,
+                        'A' + ( ( x + y + f ) % 26 ) );
+            }
+        }
+    }
+    len += snprintf( buf + len, room - len, "\033[0m" );
+    long int cells = (long int)Opts->bench * cols * rows;
+    debug( "Bench: %d frames of %dx%d, %zu bytes\n",
+            Opts->bench, cols, rows, len );
+
+    fflush( Opts->termfh );
+    initTermios(0);
+    long long start = bench_now();
+    long int rtt = -1;
+    if ( bench_send( fd, "\033[c", 3 ) ) {
+        rtt = bench_wait( start, 2000000L );
+    }
+    long int total = -1;
+    long int wrote = 0;
+    if ( 0 <= rtt ) {
+        start = bench_now();
+        if ( bench_send( fd, buf, len ) ) {
+            wrote = (long int)( bench_now() - start );
+            if ( bench_send( fd, "\033[c", 3 ) ) {
+                total = bench_wait( start, 30000000L + wrote );
+            }
+        }
+    }
+    resetTermios();
+    term_write( "\033[0m\033[H\033[2J" );
+    free( buf );
+
+    if ( 0 > rtt ) {
+        fprintf( stderr,
+                "# ERROR: No reply to Device Attributes, cannot run benchmark.\n" );
+        return 2;
+    }
+    if ( 0 > total ) {
+        fprintf( stderr, "# ERROR: No reply after the flood, gave up waiting.\n" );
+        return 2;
+    }
+    Opts->stat_d_first = rtt;
+    Opts->stat_d_final = total;
+
+    long int parse = total - rtt;
+    if ( 1 > parse ) {
+        parse = 1;
+    }
+    double bps = (double)len * 1000000.0 / parse;
+    double cps = (double)cells * 1000000.0 / parse;
+    double fps = (double)Opts->bench * 1000000.0 / parse;
+    printf( "# bench : %d frames of %dx%d, %ld cells, %zu bytes (%s)\n",
+            Opts->bench, cols, rows, cells, len, mode ? "semi" : "colon" );
+    printf( "# rtt   : %ld us\n", rtt );
+    printf( "# flood : %ld us, writes done at %ld us\n", total, wrote );
+    printf( "# rate  : %.0f bytes/s, %.0f cells/s, %.1f frames/s\n",
+            bps, cps, fps );
+    printf( "TRUECOLOR_BENCH='%.0f %.0f %.1f'\n", bps, cps, fps );
+    return 0;
+}
+
 int
 main( int argc, char **argv, char **env )
 {
@@ -2009,6 +2219,9 @@ main( int argc, char **argv, char **env )
         }
         my_exit(1);
     }
+    if ( Opts->bench ) {
+        my_exit( do_bench( mode ) );
+    }
 
     term_open();
 
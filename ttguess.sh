@@ -639,7 +639,31 @@ __q_getterm ()
     unset _TM_ITERM2
     unset _TM_EMOJI
 
-    eval `${_TERMREAD} '!' -t`
+    # The fingerprint database (termread -i) answers most terminals
+    # from one run, asking only what it needs of -t -2 -3 -e.  The
+    # case trees below are the fallback when it has no match (or no
+    # database).
+    unset TERMPROFILE
+    unset TERMCANDS
+    _TM_KITTY=0;  export _TM_KITTY
+    _TM_ITERM2=0; export _TM_ITERM2
+    eval `${_TERMREAD} '!' -i 2>/dev/null`
+    if [ -n "${TERMPROFILE}" ]
+    then
+        __debug_p "Fingerprint database profile '${TERMPROFILE}'."
+        __set_term_fallback_x ${TERMCANDS}
+        unset TERMPROFILE
+        unset TERMCANDS
+        unset ENQ
+        unset TERMID
+        unset TERM2DA
+        unset TERM3DA
+        return 0
+    fi
+    if [ -z "${TERMID}" ]
+    then
+        eval `${_TERMREAD} '!' -t`
+    fi
     __debug_p '...Primary DA "'$TERMID'".'
 
     if [ -z "${TERMID}" ]; then